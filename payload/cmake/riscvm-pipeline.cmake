@@ -0,0 +1,63 @@
+# Transpiles, links and encrypts the bitcode extracted by extract-bc.py (cmake -P, see add_riscvm_executable).
+# The outputs are cached per target by a fingerprint of the bitcode, the import map, the tools and their
+# inputs, so relinking a target without changing the code it embeds only copies the cached outputs. The
+# cache only keeps the latest entry of every target, older ones are removed when a new one is stored.
+cmake_minimum_required(VERSION 3.19)
+
+set(OUTPUTS .elf .map .bin .enc.bin)
+
+# Tools are identified by their path and modification time, hashing a statically linked LLVM takes too long
+set(FINGERPRINT "${TRANSPILER_FLAGS}|${RV64_FLAGS}")
+foreach(tool "${TRANSPILER_EXECUTABLE}" "${CLANG_EXECUTABLE}" "${LLD_EXECUTABLE}" "${OBJCOPY_EXECUTABLE}")
+    file(TIMESTAMP "${tool}" TOOL_TIMESTAMP "%Y%m%d%H%M%S" UTC)
+    string(APPEND FINGERPRINT "|${tool}@${TOOL_TIMESTAMP}")
+endforeach()
+foreach(input "${BC_BASE}.bc" "${BC_BASE}.imports" "${CRT0_OBJ}" ${PIPELINE_INPUTS})
+    file(SHA256 "${input}" INPUT_HASH)
+    string(APPEND FINGERPRINT "|${INPUT_HASH}")
+endforeach()
+string(SHA256 FINGERPRINT "${FINGERPRINT}")
+
+# The outputs embed the target's paths (the map names its object file), so every target has its own entries
+get_filename_component(BC_NAME "${BC_BASE}" NAME)
+string(SHA256 TARGET_HASH "${BC_BASE}")
+string(SUBSTRING "${TARGET_HASH}" 0 16 TARGET_HASH)
+set(TARGET_CACHE_DIR "${CACHE_DIR}/${BC_NAME}-${TARGET_HASH}")
+set(CACHE_ENTRY "${TARGET_CACHE_DIR}/${FINGERPRINT}")
+
+if(CACHE_DIR AND EXISTS "${CACHE_ENTRY}/complete")
+    foreach(output ${OUTPUTS})
+        configure_file("${CACHE_ENTRY}/${BC_NAME}${output}" "${BC_BASE}${output}" COPYONLY)
+    endforeach()
+    message(STATUS "${BC_NAME}: bitcode unchanged, using cached ${FINGERPRINT}")
+    return()
+endif()
+
+# Every step needs the previous one, so they cannot be COMMANDs of the same execute_process (those run as a pipe)
+function(run_step)
+    execute_process(
+        COMMAND ${ARGN}
+        ECHO_OUTPUT_VARIABLE
+        ECHO_ERROR_VARIABLE
+        COMMAND_ERROR_IS_FATAL ANY
+    )
+endfunction()
+
+run_step("${TRANSPILER_EXECUTABLE}" -input "${BC_BASE}.bc" -importmap "${BC_BASE}.imports" -output "${BC_BASE}.rv64.bc" ${TRANSPILER_FLAGS})
+run_step("${CLANG_EXECUTABLE}" ${RV64_FLAGS} -c "${BC_BASE}.rv64.bc" -o "${BC_BASE}.rv64.o")
+run_step("${LLD_EXECUTABLE}" -o "${BC_BASE}.elf" --oformat=elf -emit-relocs -T "${RISCVM_DIR}/lib/linker.ld" "--Map=${BC_BASE}.map" "${CRT0_OBJ}" "${BC_BASE}.rv64.o")
+run_step("${OBJCOPY_EXECUTABLE}" -O binary "${BC_BASE}.elf" "${BC_BASE}.pre.bin")
+run_step("${PYTHON_EXECUTABLE}" "${RISCVM_DIR}/relocs.py" "${BC_BASE}.elf" --binary "${BC_BASE}.pre.bin" --output "${BC_BASE}.bin")
+run_step("${PYTHON_EXECUTABLE}" "${RISCVM_DIR}/encrypt.py" --encrypt --shuffle --map "${BC_BASE}.map" --shuffle-map "${RISCVM_DIR}/shuffled_opcodes.json" --opcodes-map "${RISCVM_DIR}/opcodes.json" --output "${BC_BASE}.enc.bin" "${BC_BASE}.bin")
+
+# Marked complete last, an interrupted build never leaves a half-written entry behind
+if(CACHE_DIR)
+    file(GLOB STALE_ENTRIES LIST_DIRECTORIES true "${TARGET_CACHE_DIR}/*")
+    if(STALE_ENTRIES)
+        file(REMOVE_RECURSE ${STALE_ENTRIES})
+    endif()
+    foreach(output ${OUTPUTS})
+        configure_file("${BC_BASE}${output}" "${CACHE_ENTRY}/${BC_NAME}${output}" COPYONLY)
+    endforeach()
+    file(TOUCH "${CACHE_ENTRY}/complete")
+endif()
@@ -86,6 +86,23 @@ if(NOT TRANSPILER_MAJOR_VERSION EQUAL CLANG_MAJOR_VERSION)
     message(FATAL_ERROR "Transpiler version (${TRANSPILER_VERSION}) incompatible with Clang version (${CLANG_VERSION})")
 endif()
 
+# Resolve imports on their first call instead of all of them at startup
+option(RISCVM_LAZY_IMPORTS "Resolve imports lazily" OFF)
+set(TRANSPILER_FLAGS)
+if(RISCVM_LAZY_IMPORTS)
+    list(APPEND TRANSPILER_FLAGS -lazy-imports)
+endif()
+
+# Inline the import stubs into their callers, so loops load an import address only once
+option(RISCVM_INLINE_IMPORTS "Inline import stubs (ignored with RISCVM_LAZY_IMPORTS)" OFF)
+if(RISCVM_INLINE_IMPORTS)
+    list(APPEND TRANSPILER_FLAGS -inline-imports)
+endif()
+
+# Optimize in the transpiler for the interpreter (fewer instructions over smaller code), 0 leaves it to clang.
+# Targets can override it with set_target_properties(<target> PROPERTIES RISCVM_OPT_LEVEL <level>)
+set(RISCVM_OPT_LEVEL 0 CACHE STRING "Transpiler optimization level (0-3)")
+
 # Find system python
 find_package(Python3 COMPONENTS Interpreter REQUIRED)
 
@@ -118,24 +135,49 @@ if(NOT EXISTS "${VENV_DIR}/riscvm")
     file(TOUCH "${VENV_DIR}/riscvm")
 endif()
 
+# Everything after extracting the bitcode is skipped when the bitcode, the import map and the tools are unchanged
+option(RISCVM_PIPELINE_CACHE "Cache the transpiled and encrypted payloads" ON)
+set(RISCVM_PIPELINE_CACHE_DIR)
+if(RISCVM_PIPELINE_CACHE)
+    set(RISCVM_PIPELINE_CACHE_DIR "${CMAKE_BINARY_DIR}/riscvm-cache")
+endif()
+set(RISCVM_PIPELINE_SCRIPT "${CMAKE_CURRENT_LIST_DIR}/riscvm-pipeline.cmake")
+set(RISCVM_PIPELINE_INPUTS
+    "${RISCVM_DIR}/lib/linker.ld"
+    "${RISCVM_DIR}/relocs.py"
+    "${RISCVM_DIR}/encrypt.py"
+    "${RISCVM_DIR}/shuffled_opcodes.json"
+    "${RISCVM_DIR}/opcodes.json"
+    "${RISCVM_PIPELINE_SCRIPT}"
+)
+
 function(add_riscvm_executable tgt)
     add_executable(${tgt} ${ARGN})
     if(MSVC)
         target_compile_definitions(${tgt} PRIVATE _NO_CRT_STDIO_INLINE)
         target_compile_options(${tgt} PRIVATE /GS- /Zc:threadSafeInit-)
     endif()
+    set_target_properties(${tgt} PROPERTIES RISCVM_OPT_LEVEL "${RISCVM_OPT_LEVEL}")
     set(BC_BASE "$<TARGET_FILE_DIR:${tgt}>/$<TARGET_FILE_BASE_NAME:${tgt}>")
     add_custom_command(TARGET ${tgt}
         POST_BUILD
         USES_TERMINAL
         COMMENT "Extracting and transpiling bitcode..."
         COMMAND "${Python3_EXECUTABLE}" "${RISCVM_DIR}/extract-bc.py" "$<TARGET_FILE:${tgt}>" -o "${BC_BASE}.bc" --importmap "${BC_BASE}.imports"
-        COMMAND "${TRANSPILER_EXECUTABLE}" -input "${BC_BASE}.bc" -importmap "${BC_BASE}.imports" -output "${BC_BASE}.rv64.bc"
-        COMMAND "${CLANG_EXECUTABLE}" ${RV64_FLAGS} -c "${BC_BASE}.rv64.bc" -o "${BC_BASE}.rv64.o"
-        COMMAND "${LLD_EXECUTABLE}" -o "${BC_BASE}.elf" --oformat=elf -emit-relocs -T "${RISCVM_DIR}/lib/linker.ld" "--Map=${BC_BASE}.map" "${CRT0_OBJ}" "${BC_BASE}.rv64.o"
-        COMMAND "${OBJCOPY_EXECUTABLE}" -O binary "${BC_BASE}.elf" "${BC_BASE}.pre.bin"
-        COMMAND "${Python3_EXECUTABLE}" "${RISCVM_DIR}/relocs.py" "${BC_BASE}.elf" --binary "${BC_BASE}.pre.bin" --output "${BC_BASE}.bin"
-        COMMAND "${Python3_EXECUTABLE}" "${RISCVM_DIR}/encrypt.py" --encrypt --shuffle --map "${BC_BASE}.map" --shuffle-map "${RISCVM_DIR}/shuffled_opcodes.json" --opcodes-map "${RISCVM_DIR}/opcodes.json" --output "${BC_BASE}.enc.bin" "${BC_BASE}.bin"
+        COMMAND "${CMAKE_COMMAND}"
+            "-DBC_BASE=${BC_BASE}"
+            "-DCACHE_DIR=${RISCVM_PIPELINE_CACHE_DIR}"
+            "-DTRANSPILER_EXECUTABLE=${TRANSPILER_EXECUTABLE}"
+            "-DTRANSPILER_FLAGS=-O$<TARGET_PROPERTY:${tgt},RISCVM_OPT_LEVEL>;${TRANSPILER_FLAGS}"
+            "-DCLANG_EXECUTABLE=${CLANG_EXECUTABLE}"
+            "-DRV64_FLAGS=${RV64_FLAGS}"
+            "-DLLD_EXECUTABLE=${LLD_EXECUTABLE}"
+            "-DOBJCOPY_EXECUTABLE=${OBJCOPY_EXECUTABLE}"
+            "-DPYTHON_EXECUTABLE=${Python3_EXECUTABLE}"
+            "-DRISCVM_DIR=${RISCVM_DIR}"
+            "-DCRT0_OBJ=${CRT0_OBJ}"
+            "-DPIPELINE_INPUTS=${RISCVM_PIPELINE_INPUTS}"
+            -P "${RISCVM_PIPELINE_SCRIPT}"
         VERBATIM
     )
 endfunction()
@@ -1,10 +1,26 @@
 #include "httplib.h"
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <inttypes.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "../riscvm.h"
+#include "../sched/sched.h"
+#include "metrics.h"
 
-static std::atomic<uint32_t>    g_request_id = 0;
-static thread_local std::string g_response_data;
+static std::atomic<uint32_t> g_request_id = 0;
 
 #ifdef _WIN32
 #define EXPORT __declspec(dllexport)
@@ -12,121 +28,1160 @@ static thread_local std::string g_response_data;
 #define EXPORT __attribute__((visibility("default")))
 #endif // _WIN32
 
+#ifndef PAGED_MEMORY
+// Guest memory for one request: the payload is copied to code and the stack follows it
+struct Arena
+{
+    uint8_t* memory    = nullptr;
+    uint8_t* code      = nullptr;
+    uint8_t* stack_top = nullptr; // host stack, unused in the sandbox
+    size_t   capacity  = 0;       // maximum payload size
+    size_t   used      = 0;       // bytes that have to be scrubbed before reuse
+};
+
+#ifndef SANDBOX_MEMORY
+#define ARENA_CODE_SIZE  0x100000
+#define ARENA_STACK_SIZE 0x10000
+#define ARENA_ALIGNMENT  0x1000
+#endif // SANDBOX_MEMORY
+
+/*
+ * Keeps preallocated arenas around between requests so a sustained request
+ * rate does not pay for allocating (and page faulting) fresh guest memory
+ * every time. Payloads that do not fit a standard arena get a one-off arena.
+ */
+class ArenaPool
+{
+    std::mutex         m_mutex;
+    std::vector<Arena> m_idle;
+    size_t             m_max_idle;
+
+  public:
+    explicit ArenaPool(size_t max_idle) : m_max_idle(max_idle)
+    {
+    }
+
+    ~ArenaPool()
+    {
+        for (auto& arena : m_idle)
+        {
+            destroy(arena);
+        }
+    }
+
+    // Sizes that are served from the idle arenas, anything bigger allocates a new one
+    static size_t pooled_size()
+    {
+        return standard_capacity();
+    }
+
+    static size_t max_size()
+    {
+#ifdef SANDBOX_MEMORY
+        return standard_capacity();
+#else
+        return SIZE_MAX;
+#endif // SANDBOX_MEMORY
+    }
+
+    bool acquire(size_t size, Arena& arena)
+    {
+        if (size <= standard_capacity())
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_idle.empty())
+            {
+                arena = m_idle.back();
+                m_idle.pop_back();
+                return true;
+            }
+        }
+        return create(size, arena);
+    }
+
+    void release(Arena& arena)
+    {
+        if (arena.capacity == standard_capacity() && scrub(arena))
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_idle.size() < m_max_idle)
+            {
+                m_idle.push_back(arena);
+                arena = {};
+                return;
+            }
+        }
+        destroy(arena);
+        arena = {};
+    }
+
+  private:
+#ifdef SANDBOX_MEMORY
+    static size_t standard_capacity()
+    {
+        // Leave at least half of the sandbox for the stack and data
+        return RISCVM_SANDBOX_SIZE / 2;
+    }
+
+    static bool create(size_t size, Arena& arena)
+    {
+        (void)size;
+        arena.memory = riscvm_sandbox_alloc();
+        if (arena.memory == nullptr)
+        {
+            return false;
+        }
+        arena.code     = arena.memory + RISCVM_SANDBOX_CODE;
+        arena.capacity = standard_capacity();
+        return true;
+    }
+
+    static bool scrub(Arena& arena)
+    {
+        arena.used = 0;
+        return riscvm_sandbox_reset(arena.memory);
+    }
+
+    static void destroy(Arena& arena)
+    {
+        riscvm_sandbox_free(arena.memory);
+    }
+#else
+    static size_t standard_capacity()
+    {
+        return ARENA_CODE_SIZE;
+    }
+
+    static bool create(size_t size, Arena& arena)
+    {
+        auto capacity = size <= ARENA_CODE_SIZE ? ARENA_CODE_SIZE : (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+        arena.memory  = (uint8_t*)operator new(capacity + ARENA_STACK_SIZE, std::align_val_t(ARENA_ALIGNMENT), std::nothrow);
+        if (arena.memory == nullptr)
+        {
+            return false;
+        }
+        memset(arena.memory, 0, capacity + ARENA_STACK_SIZE);
+        arena.code      = arena.memory;
+        arena.stack_top = arena.memory + capacity + ARENA_STACK_SIZE;
+        arena.capacity  = capacity;
+        return true;
+    }
+
+    static bool scrub(Arena& arena)
+    {
+        // Only the pages the payload was copied to and the stack can be dirty
+        auto used = (arena.used + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+        memset(arena.code, 0, used < arena.capacity ? used : arena.capacity);
+        memset(arena.stack_top - ARENA_STACK_SIZE, 0, ARENA_STACK_SIZE);
+        arena.used = 0;
+        return true;
+    }
+
+    static void destroy(Arena& arena)
+    {
+        operator delete(arena.memory, std::align_val_t(ARENA_ALIGNMENT));
+    }
+#endif // SANDBOX_MEMORY
+};
+
+static ArenaPool g_arena_pool(std::thread::hardware_concurrency() * 2);
+#endif // PAGED_MEMORY
+
+// Upper bounds for a single request, a guest that runs longer is stopped
+#define C2_INSTRUCTION_BUDGET 1000000000ll
+#define C2_TIMEOUT_US         10000000ull
+// Guests that run side by side on the scheduler, per worker thread
+#define C2_GUESTS_PER_THREAD 16
+// Threads for guests parked on blocking host calls
+#define C2_BLOCKING_THREADS 4
+// HTTP workers on top of the ones for admitted guests, and how long a connection may hold one
+#define C2_SPARE_WORKERS       4
+#define C2_KEEP_ALIVE_SECONDS  1
+#define C2_KEEP_ALIVE_REQUESTS 4
+
+static riscvm_scheduler* g_scheduler;
+static size_t            g_max_guests;
+
+// Admitted guests, counted from before the upload until the guest is done
+static std::atomic<size_t> g_reserved_guests = 0;
+
+/*
+ * A reservation for one guest. Requests take it before the body is read, so
+ * a busy server turns them away without buffering their payload or taking an
+ * arena. It is released when the guest and its memory are gone.
+ */
+class GuestSlot
+{
+    bool m_held = false;
+
+  public:
+    GuestSlot() = default;
+
+    GuestSlot(const GuestSlot&)            = delete;
+    GuestSlot& operator=(const GuestSlot&) = delete;
+
+    GuestSlot(GuestSlot&& other) noexcept : m_held(std::exchange(other.m_held, false))
+    {
+    }
+
+    GuestSlot& operator=(GuestSlot&& other) noexcept
+    {
+        release();
+        m_held = std::exchange(other.m_held, false);
+        return *this;
+    }
+
+    ~GuestSlot()
+    {
+        release();
+    }
+
+    bool acquire()
+    {
+        if (m_held)
+        {
+            return true;
+        }
+        auto reserved = g_reserved_guests.load();
+        do
+        {
+            if (reserved >= g_max_guests)
+            {
+                return false;
+            }
+        } while (!g_reserved_guests.compare_exchange_weak(reserved, reserved + 1));
+        m_held = true;
+        return true;
+    }
+
+    void release()
+    {
+        if (m_held)
+        {
+            g_reserved_guests.fetch_sub(1);
+            m_held = false;
+        }
+    }
+};
+
+#pragma pack(1)
+struct Features
+{
+    uint32_t magic;
+    struct
+    {
+        bool encrypted  : 1;
+        bool shuffled   : 1;
+        bool opcode_map : 1;
+    };
+    uint32_t key;
+};
+#pragma pack()
+static_assert(sizeof(Features) == 9, "");
+
+// Validated payload with everything that is derived from it at load time
+struct Payload
+{
+    std::vector<uint8_t> image; // code without the RV64 header, kept to verify cache hits
+    uint32_t             key = 0;
+#ifdef OPCODE_SHUFFLING
+    riscvm_opcode_map opcode_map;
+#endif // OPCODE_SHUFFLING
+};
+
+static std::shared_ptr<const Payload> prepare_payload(const uint8_t* image, size_t size, const char*& error)
+{
+    auto payload   = std::make_shared<Payload>();
+    payload->image = std::vector<uint8_t>(image, image + size);
+
+    Features features = {};
+    if (size >= sizeof(Features))
+    {
+        memcpy(&features, image + size - sizeof(Features), sizeof(Features));
+    }
+    if (features.magic != RISCVM_IMAGE_FEATURES_MAGIC)
+    {
+        printf("[c2] no features in the file (unencrypted payload?)\n");
+#if defined(CODE_ENCRYPTION)
+        error = "no features in the file";
+        return nullptr;
+#endif // CODE_ENCRYPTION
+        features = {};
+    }
+
+#ifdef OPCODE_SHUFFLING
+    riscvm_load_opcode_map(&payload->opcode_map, nullptr);
+    if (features.shuffled)
+    {
+        if (!features.opcode_map || size < sizeof(Features) + sizeof(riscvm_encoded_map))
+        {
+            error = "no opcode map in the shuffled bytecode";
+            return nullptr;
+        }
+        auto encoded = (const riscvm_encoded_map*)(image + size - sizeof(Features) - sizeof(riscvm_encoded_map));
+        riscvm_load_opcode_map(&payload->opcode_map, encoded);
+    }
+#else
+    if (features.shuffled)
+    {
+        error = "shuffling disabled on the host, enabled in the bytecode";
+        return nullptr;
+    }
+#endif // OPCODE_SHUFFLING
+
+#ifdef CODE_ENCRYPTION
+    if (!features.encrypted)
+    {
+        error = "encryption enabled on the host, disabled in the bytecode";
+        return nullptr;
+    }
+#else
+    if (features.encrypted)
+    {
+        error = "encryption disabled on the host, enabled in the bytecode";
+        return nullptr;
+    }
+#endif // CODE_ENCRYPTION
+    payload->key = features.key;
+    return payload;
+}
+
+/*
+ * Prepared payloads keyed by a hash of the payload, so clients that
+ * submit the same payload again skip the validation and decoding. Hits are
+ * compared byte for byte, the hash only selects the candidate. The least
+ * recently used payloads are evicted once the images exceed the byte limit.
+ */
+class PayloadCache
+{
+    using Entry = std::pair<uint64_t, std::shared_ptr<const Payload>>;
+
+    std::mutex                                               m_mutex;
+    std::list<Entry>                                         m_lru; // most recently used first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> m_index;
+    size_t                                                   m_bytes = 0;
+    size_t                                                   m_max_bytes;
+
+  public:
+    explicit PayloadCache(size_t max_bytes) : m_max_bytes(max_bytes)
+    {
+    }
+
+    std::shared_ptr<const Payload> find(uint64_t digest, const uint8_t* image, size_t size)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto                        itr = m_index.find(digest);
+        if (itr == m_index.end())
+        {
+            return nullptr;
+        }
+        auto& payload = itr->second->second;
+        if (payload->image.size() != size || memcmp(payload->image.data(), image, size) != 0)
+        {
+            return nullptr;
+        }
+        m_lru.splice(m_lru.begin(), m_lru, itr->second);
+        return payload;
+    }
+
+    void insert(uint64_t digest, std::shared_ptr<const Payload> payload)
+    {
+        auto size = payload->image.size();
+        if (size > m_max_bytes)
+        {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto                        itr = m_index.find(digest);
+        if (itr != m_index.end())
+        {
+            // Either a concurrent insert of the same payload or a hash collision, the newest wins
+            m_bytes -= itr->second->second->image.size();
+            m_lru.erase(itr->second);
+            m_index.erase(itr);
+        }
+        while (!m_lru.empty() && m_bytes + size > m_max_bytes)
+        {
+            auto& oldest = m_lru.back();
+            m_bytes -= oldest.second->image.size();
+            m_index.erase(oldest.first);
+            m_lru.pop_back();
+        }
+        m_lru.emplace_front(digest, std::move(payload));
+        m_index[digest] = m_lru.begin();
+        m_bytes += size;
+    }
+};
+
+// Upper bound for the images in the payload cache
+#define C2_PAYLOAD_CACHE_BYTES (64 * 1024 * 1024)
+
+static PayloadCache g_payload_cache(C2_PAYLOAD_CACHE_BYTES);
+
+// FNV-1a, computed incrementally while the payload is received
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME        0x100000001b3ull
+
+static uint64_t fnv1a(uint64_t hash, const uint8_t* data, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ data[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/*
+ * Payloads that fit a pooled arena are received straight into guest memory,
+ * bigger ones are buffered as they arrive and only get guest memory once they
+ * are complete, so the Content-Length alone never allocates more than that.
+ */
+#define C2_MAX_PAYLOAD_SIZE (64 * 1024 * 1024)
+// Upload buffers are reused between requests, unless a payload made them huge
+#define C2_UPLOAD_KEEP_BYTES (1024 * 1024)
+// Response buffers are reused between requests, unless a guest made them huge
+#define C2_RESPONSE_KEEP_BYTES (1024 * 1024)
+// Output that may pile up for a slow client before a streaming guest is parked
+#define C2_STREAM_BUFFER_BYTES (64 * 1024)
+
+static thread_local std::string t_response_data;
+// Uploads that do not go straight to guest memory (always with paged memory, the pages are not contiguous)
+static thread_local std::vector<uint8_t> t_upload;
+
+static void release_response_data()
+{
+    if (t_response_data.capacity() > C2_RESPONSE_KEEP_BYTES)
+    {
+        std::string().swap(t_response_data);
+    }
+}
+
+static void release_upload()
+{
+    t_upload.clear();
+    if (t_upload.capacity() > C2_UPLOAD_KEEP_BYTES)
+    {
+        std::vector<uint8_t>().swap(t_upload);
+    }
+}
+
+/*
+ * Guest output on its way to the client. Without a limit everything is
+ * collected for the response, with a limit the writer has to wait once that
+ * much output is pending until the reader drained it.
+ */
+class OutputChannel
+{
+    std::mutex              m_mutex;
+    std::condition_variable m_cond;
+    std::string&            m_buffer;
+    size_t                  m_limit;
+    bool                    m_closed    = false;
+    bool                    m_cancelled = false;
+
+  public:
+    OutputChannel(std::string& buffer, size_t limit) : m_buffer(buffer), m_limit(limit)
+    {
+        m_buffer.clear();
+    }
+
+    // Appends as much of data as fits and advances it, returns false if the rest has to wait
+    bool write(std::string_view& data)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return append(data);
+    }
+
+    // Appends all of data, the rest is dropped if the reader does not catch up before the deadline
+    void write_all(std::string_view data, std::chrono::steady_clock::time_point deadline)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!append(data))
+        {
+            if (!m_cond.wait_until(lock, deadline, [this] { return m_cancelled || m_buffer.size() < m_limit; }))
+            {
+                return;
+            }
+        }
+    }
+
+    // Waits for output and moves it to chunk, returns false once the channel is closed and drained
+    bool read(std::string& chunk)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [this] { return m_closed || !m_buffer.empty(); });
+        chunk.assign(m_buffer);
+        m_buffer.clear();
+        m_cond.notify_all();
+        return !chunk.empty();
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_cond.notify_all();
+    }
+
+    // The reader is gone, pending and future output is discarded
+    void cancel()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_cancelled = true;
+        m_cond.notify_all();
+    }
+
+    bool cancelled()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_cancelled;
+    }
+
+  private:
+    bool append(std::string_view& data)
+    {
+        if (m_cancelled)
+        {
+            data = {};
+            return true;
+        }
+        auto size = std::min(data.size(), m_limit - std::min(m_limit, m_buffer.size()));
+        if (size > 0)
+        {
+            m_buffer.append(data.data(), size);
+            data.remove_prefix(size);
+            m_cond.notify_all();
+        }
+        return data.empty();
+    }
+};
+
+// A guest with its memory and output, kept alive by the response until the guest is done
+struct Execution
+{
+    GuestSlot                      slot; // first, so it is released after the memory
+    riscvm                         vm = {};
+    riscvm_task                    task;
+    OutputChannel                  output;
+    std::promise<void>             finished;
+    std::shared_future<void>       done;
+    std::shared_ptr<const Payload> payload;
+
+    std::chrono::steady_clock::time_point started;
+#ifndef PAGED_MEMORY
+    Arena arena;
+#endif // PAGED_MEMORY
+
+    Execution(std::string& output_buffer, size_t output_limit)
+        : output(output_buffer, output_limit)
+        , done(finished.get_future().share())
+    {
+    }
+
+    ~Execution()
+    {
+#ifdef TRACING
+        if (vm.trace != nullptr)
+        {
+            fclose(vm.trace);
+        }
+#endif // TRACING
+#ifdef PAGED_MEMORY
+        riscvm_paged_free(&vm);
+#else
+        if (arena.memory != nullptr)
+        {
+            g_arena_pool.release(arena);
+        }
+#endif // PAGED_MEMORY
+    }
+};
+
 extern "C" EXPORT void append_response(const char* data)
 {
-    g_response_data += data;
+    // Guests move between scheduler threads, the output belongs to the task
+    auto task = riscvm_scheduler::current();
+    if (task == nullptr)
+    {
+        return;
+    }
+    auto execution = (Execution*)task->userdata;
+    if (execution->output.cancelled())
+    {
+        // Nobody is listening anymore, stop the guest
+        task->vm->status = riscvm_status_exited;
+        return;
+    }
+    std::string_view pending(data);
+    if (!execution->output.write(pending))
+    {
+        // The client is behind, park the guest until it caught up
+        riscvm_scheduler::block(
+            [execution, pending]() -> uint64_t
+            {
+                execution->output.write_all(pending, execution->task.deadline);
+                return 0;
+            }
+        );
+    }
+}
+
+// Sets up the guest for the payload in its memory, fails with an HTTP status and message
+static bool load_execution(Execution& execution, const uint8_t* code, size_t code_size, uint64_t digest, int& status, const char*& error)
+{
+    auto payload = g_payload_cache.find(digest, code, code_size);
+    if (payload == nullptr)
+    {
+        payload = prepare_payload(code, code_size, error);
+        if (payload == nullptr)
+        {
+            status = 400;
+            printf("[c2] %s\n", error);
+            return false;
+        }
+        g_payload_cache.insert(digest, payload);
+    }
+    execution.payload = payload;
+
+    auto self        = &execution.vm;
+    self->on_syscall = [](riscvm*, uint64_t code) { g_metrics.syscall(code); };
+    reg_write(reg_a0, RISCVM_HOST_FEATURES);
+#if defined(SANDBOX_MEMORY)
+    self->memory = execution.arena.memory;
+    reg_write(reg_sp, RISCVM_SANDBOX_STACK_TOP - 0x18);
+    self->pc = (int64_t)RISCVM_SANDBOX_CODE;
+#elif defined(PAGED_MEMORY)
+    auto data_start = (RISCVM_PAGED_CODE + code_size + RISCVM_PAGE_OFFSET) & ~RISCVM_PAGE_OFFSET;
+    if (!riscvm_paged_map(self, RISCVM_PAGED_CODE, code_size, riscvm_page_read | riscvm_page_write | riscvm_page_exec) ||
+        !riscvm_paged_map(self, data_start, RISCVM_PAGED_STACK_TOP - data_start, riscvm_page_read | riscvm_page_write) ||
+        !riscvm_paged_copy(self, RISCVM_PAGED_CODE, code, code_size))
+    {
+        status = 500;
+        error  = "Failed to map guest memory";
+        printf("[c2] failed to map guest memory!\n");
+        return false;
+    }
+    reg_write(reg_sp, RISCVM_PAGED_STACK_TOP - 0x18);
+    self->pc = (int64_t)RISCVM_PAGED_CODE;
+#else
+    reg_write(reg_sp, (uint64_t)(execution.arena.stack_top - 0x18));
+    self->pc = (int64_t)execution.arena.code;
+#endif // SANDBOX_MEMORY
+
+#ifdef OPCODE_SHUFFLING
+    self->opcodes = &payload->opcode_map;
+#endif // OPCODE_SHUFFLING
+
+#ifdef CODE_ENCRYPTION
+    self->base = self->pc;
+    self->key  = payload->key;
+#endif // CODE_ENCRYPTION
+    return true;
+}
+
+// Guests are time-sliced with all the other requests on the scheduler threads
+static bool spawn_execution(Execution& execution)
+{
+    auto& task    = execution.task;
+    task.vm       = &execution.vm;
+    task.userdata = &execution;
+    task.budget   = C2_INSTRUCTION_BUDGET;
+    task.deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(C2_TIMEOUT_US);
+    task.done     = [execution = &execution](riscvm_task& task)
+    {
+        auto elapsed = std::chrono::steady_clock::now() - execution->started;
+        g_metrics.execution(
+            C2_INSTRUCTION_BUDGET - std::max<int64_t>(task.budget, 0),
+            std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count()
+        );
+        execution->output.close();
+        execution->finished.set_value();
+    };
+    execution.started = std::chrono::steady_clock::now();
+    return g_scheduler->spawn(&task, g_max_guests);
+}
+
+// The body may still be unread, so the connection cannot be reused
+static void reject_busy(httplib::Response& res)
+{
+    res.status = 503;
+    res.set_header("Retry-After", "1");
+    res.set_header("Connection", "close");
+    res.set_content("Server busy", "text/plain");
+    printf("[c2] too many guests running, rejecting request\n");
 }
 
-static void handle_riscvm(const httplib::Request& req, httplib::Response& res)
+static void handle_riscvm(const httplib::Request& req, httplib::Response& res, const httplib::ContentReader& content_reader)
 {
     auto request_id = g_request_id.fetch_add(1);
-    g_response_data.clear();
+    g_metrics.request(req.get_header_value<uint64_t>("Content-Length"));
 
-    const std::string& body = req.body;
-    if (body.size() < 0x10 || memcmp(body.c_str(), "RV64", 4) != 0)
+    if (!req.has_header("Content-Length"))
+    {
+        res.status = 411;
+        res.set_content("Content-Length required", "text/plain");
+        printf("[c2] payload without a length!\n");
+        return;
+    }
+    auto body_size = req.get_header_value<uint64_t>("Content-Length");
+    if (body_size < 0x10)
     {
         res.status = 400;
         res.set_content("Invalid RV64 code", "text/plain");
         printf("[c2] invalid payload header!\n");
         return;
     }
-    std::vector<uint8_t> vm_code((body.size() + 0xFFF) & ~0xFFF);
-    memcpy(vm_code.data(), body.c_str() + 4, body.size());
-    std::vector<uint8_t> stack(0x10000);
+    size_t code_size = body_size - 4;
+#ifdef PAGED_MEMORY
+    if (code_size > C2_MAX_PAYLOAD_SIZE || code_size > RISCVM_PAGED_SIZE / 2)
+#else
+    if (code_size > C2_MAX_PAYLOAD_SIZE || code_size > ArenaPool::max_size())
+#endif // PAGED_MEMORY
+    {
+        res.status = 413;
+        res.set_content("RV64 code too big", "text/plain");
+        printf("[c2] payload too big for the guest memory!\n");
+        return;
+    }
+    GuestSlot slot;
+    if (!slot.acquire())
+    {
+        reject_busy(res);
+        return;
+    }
+
+    // Streaming responses send the guest output as it is produced
+    auto streaming  = req.has_param("stream");
+    auto execution  = std::make_shared<Execution>(t_response_data, streaming ? C2_STREAM_BUFFER_BYTES : SIZE_MAX);
+    execution->slot = std::move(slot);
+
+#ifdef PAGED_MEMORY
+    auto     direct = false;
+    uint8_t* code   = nullptr;
+#else
+    auto& arena = execution->arena;
+    auto  direct = code_size <= ArenaPool::pooled_size();
+    if (direct && !g_arena_pool.acquire(code_size, arena))
+    {
+        res.status = 500;
+        res.set_content("Failed to allocate guest memory", "text/plain");
+        printf("[c2] failed to allocate guest memory!\n");
+        return;
+    }
+    auto code = direct ? arena.code : nullptr;
+#endif // PAGED_MEMORY
 
-    printf("[c2] executing %zu byte payload\n", body.size());
+    // The header is checked on the way
+    char     header[4] = {};
+    size_t   received  = 0;
+    uint64_t digest    = FNV_OFFSET_BASIS;
+    auto     complete  = content_reader(
+        [&](const char* data, size_t size)
+        {
+            while (size > 0 && received < sizeof(header))
+            {
+                header[received++] = *data++;
+                size--;
+            }
+            if (size == 0)
+            {
+                return true;
+            }
+            if (received - sizeof(header) + size > code_size)
+            {
+                return false;
+            }
+            if (direct)
+            {
+                memcpy(code + received - sizeof(header), data, size);
+            }
+            else
+            {
+                t_upload.insert(t_upload.end(), data, data + size);
+            }
+            digest = fnv1a(digest, (const uint8_t*)data, size);
+            received += size;
+            return true;
+        }
+    );
+#ifndef PAGED_MEMORY
+    arena.used = received < sizeof(header) || !direct ? 0 : received - sizeof(header);
+#endif // PAGED_MEMORY
+    if (!complete || received != body_size || memcmp(header, "RV64", 4) != 0)
+    {
+        release_upload();
+        res.status = 400;
+        res.set_content("Invalid RV64 code", "text/plain");
+        printf("[c2] invalid payload header!\n");
+        return;
+    }
+#ifdef PAGED_MEMORY
+    code = t_upload.data();
+#else
+    if (!direct)
+    {
+        auto acquired = g_arena_pool.acquire(code_size, arena);
+        if (acquired)
+        {
+            memcpy(arena.code, t_upload.data(), code_size);
+            arena.used = code_size;
+        }
+        release_upload();
+        if (!acquired)
+        {
+            res.status = 500;
+            res.set_content("Failed to allocate guest memory", "text/plain");
+            printf("[c2] failed to allocate guest memory!\n");
+            return;
+        }
+        code = arena.code;
+    }
+#endif // PAGED_MEMORY
+
+    printf("[c2] executing %zu byte payload\n", (size_t)body_size);
 
-    riscvm vm = {};
 #ifdef TRACING
-    auto trace = req.get_param_value("trace");
+    auto& vm    = execution->vm;
+    auto  trace = req.get_param_value("trace");
     if (!trace.empty())
     {
-        printf(
-            "[c2] tracing enabled (base: %p, first instruction: 0x%08x)\n",
-            vm_code.data(),
-            *(uint32_t*)vm_code.data()
-        );
+        printf("[c2] tracing enabled (base: %p, first instruction: 0x%08x)\n", code, *(uint32_t*)code);
         auto filename = "c2-" + std::to_string(request_id) + ".trace";
         vm.trace      = fopen(filename.c_str(), "w");
-        vm.rebase     = -(int64_t)vm_code.data();
+#if defined(SANDBOX_MEMORY)
+        vm.rebase = -(int64_t)RISCVM_SANDBOX_CODE;
+#elif defined(PAGED_MEMORY)
+        vm.rebase = -(int64_t)RISCVM_PAGED_CODE;
+#else
+        vm.rebase = -(int64_t)arena.code;
+#endif // SANDBOX_MEMORY
     }
 #else
     (void)request_id;
 #endif // TRACING
 
-    auto self = &vm;
-    reg_write(reg_a0, 0x1122334455667788);
-    reg_write(reg_sp, (uint64_t)(stack.data() + stack.size() - 0x18));
-    self->pc = (int64_t)vm_code.data();
+    int         status = 0;
+    const char* error  = nullptr;
+    auto        loaded = load_execution(*execution, code, code_size, digest, status, error);
+#ifdef PAGED_MEMORY
+    release_upload();
+#endif // PAGED_MEMORY
+    if (!loaded)
+    {
+        res.status = status;
+        res.set_content(error, "text/plain");
+        return;
+    }
 
-#pragma pack(1)
-    struct Features
+    if (!spawn_execution(*execution))
     {
-        uint32_t magic;
-        struct
-        {
-            bool encrypted : 1;
-            bool shuffled  : 1;
-        };
-        uint32_t key;
-    };
-    static_assert(sizeof(Features) == 9, "");
+        reject_busy(res);
+        return;
+    }
 
-    auto features = (Features*)(vm_code.data() + body.size() - 4 - sizeof(Features));
-    if (features->magic != 'TAEF')
+    if (streaming)
     {
-        printf("[c2] no features in the file (unencrypted payload?)\n");
-#if defined(CODE_ENCRYPTION) || defined(OPCODE_SHUFFLING)
+        // The outcome is only known at the end, so it follows the data
+        auto prefix = "epoch:" + std::to_string(time(nullptr)) + "\ndata:";
+        res.set_chunked_content_provider(
+            "text/plain",
+            [execution, prefix = std::move(prefix)](size_t offset, httplib::DataSink& sink)
+            {
+                if (offset == 0 && !sink.write(prefix.data(), prefix.size()))
+                {
+                    return false;
+                }
+                std::string chunk;
+                if (execution->output.read(chunk))
+                {
+                    return sink.write(chunk.data(), chunk.size());
+                }
+
+                std::string trailer;
+                switch (execution->task.status)
+                {
+                case riscvm_status_budget:
+                    trailer = "\nerror:Instruction budget exhausted\n";
+                    break;
+                case riscvm_status_fault:
+                    trailer = "\nerror:Guest fault\n";
+                    break;
+                default:
+                    trailer = "\nstatus:" + std::to_string((int)execution->vm.regs[reg_a0]) + "\n";
+                    break;
+                }
+                sink.write(trailer.data(), trailer.size());
+                sink.done();
+                return true;
+            },
+            [execution](bool)
+            {
+                // The guest writes to this thread's buffer until it is done
+                execution->output.cancel();
+                execution->done.wait();
+                release_response_data();
+            }
+        );
         return;
-#endif // CODE_ENCRYPTION || OPCODE_SHUFFLING
     }
 
-#ifdef OPCODE_SHUFFLING
-    if (!features->shuffled)
+    execution->done.wait();
+    auto vm_status = execution->task.status;
+    auto exit_code = (int)execution->vm.regs[reg_a0];
+
+    if (vm_status == riscvm_status_budget)
     {
-        printf("[c2] shuffling enabled on the host, disabled in the bytecode");
+        res.status = 504;
+        res.set_content("Instruction budget exhausted", "text/plain");
+        printf("[c2] instruction budget exhausted!\n");
         return;
     }
-#else
-    if (features->shuffled)
+    if (vm_status == riscvm_status_fault)
     {
-        printf("[c2] shuffling disabled on the host, enabled in the bytecode");
+        res.status = 500;
+        res.set_content("Guest fault", "text/plain");
+        printf("[c2] guest fault at pc 0x%" PRIx64 "!\n", execution->vm.pc);
         return;
     }
-#endif // OPCODE_SHUFFLING
 
-#ifdef CODE_ENCRYPTION
-    if (!features->encrypted)
+    // The provider runs on this thread once the handler returns, so the buffer is still ours
+    auto prefix = "epoch:" + std::to_string(time(nullptr)) + "\nstatus:" + std::to_string(exit_code) + "\ndata:";
+    res.set_chunked_content_provider(
+        "text/plain",
+        [prefix = std::move(prefix)](size_t, httplib::DataSink& sink)
+        {
+            sink.write(prefix.data(), prefix.size());
+            if (!t_response_data.empty())
+            {
+                sink.write(t_response_data.data(), t_response_data.size());
+            }
+            sink.write("\n", 1);
+            sink.done();
+            return true;
+        },
+        [](bool) { release_response_data(); }
+    );
+
+    printf("[c2] riscvm_run returned exit code %d\n", exit_code);
+}
+
+// Payloads of one batch that run at the same time, the rest waits for a slot
+#define C2_BATCH_WINDOW 64
+#define C2_BATCH_MAX    4096
+
+#pragma pack(1)
+struct BatchResult
+{
+    uint32_t status;    // HTTP status of the payload
+    int32_t  exit_code; // only meaningful with status 200
+    uint32_t size;      // followed by the output, or the error message
+};
+#pragma pack()
+
+/*
+ * Runs many small payloads with a single round-trip. All integers are little
+ * endian. The request is "RVB1", the u32 number of payloads and for every
+ * payload its u32 size followed by the payload as it would be posted to
+ * /riscvm. The response is "RVB1", the same count and a BatchResult plus
+ * data for every payload, in request order.
+ */
+static void handle_batch(const httplib::Request&, httplib::Response& res, const httplib::ContentReader& content_reader)
+{
+    // The first guest runs on the slot the batch was admitted with
+    GuestSlot admission;
+    if (!admission.acquire())
     {
-        printf("[c2] encryption enabled on the host, disabled in the bytecode");
+        reject_busy(res);
         return;
     }
-    self->base = self->pc;
-    self->key  = features->key;
-#else
-    if (features->encrypted)
+    std::string body;
+    auto        complete = content_reader(
+        [&](const char* data, size_t size)
+        {
+            if (body.size() + size > C2_MAX_PAYLOAD_SIZE)
+            {
+                return false;
+            }
+            body.append(data, size);
+            return true;
+        }
+    );
+    if (!complete)
     {
-        printf("[c2] encryption disabled on the host, enabled in the bytecode");
+        res.status = 413;
+        res.set_header("Connection", "close");
+        res.set_content("Batch too big", "text/plain");
+        printf("[c2] batch too big!\n");
         return;
     }
-#endif // CODE_ENCRYPTION
 
-    riscvm_run(self);
-    auto status = (int)reg_read(reg_a0);
+    uint32_t count  = 0;
+    size_t   offset = 8;
+    if (body.size() < offset || memcmp(body.data(), "RVB1", 4) != 0)
+    {
+        res.status = 400;
+        res.set_content("Invalid batch", "text/plain");
+        printf("[c2] invalid batch header!\n");
+        return;
+    }
+    memcpy(&count, body.data() + 4, sizeof(count));
+    if (count > C2_BATCH_MAX)
+    {
+        res.status = 413;
+        res.set_content("Too many payloads", "text/plain");
+        printf("[c2] batch with %u payloads is too big!\n", count);
+        return;
+    }
 
-#ifdef TRACING
-    if (vm.trace != nullptr)
+    // Validate the framing up front, nothing runs for a malformed batch
+    std::vector<std::pair<const uint8_t*, size_t>> frames;
+    frames.reserve(count);
+    for (uint32_t i = 0; i < count; i++)
     {
-        fclose(vm.trace);
+        uint32_t size = 0;
+        if (body.size() - offset < sizeof(size))
+        {
+            break;
+        }
+        memcpy(&size, body.data() + offset, sizeof(size));
+        offset += sizeof(size);
+        if (body.size() - offset < size)
+        {
+            break;
+        }
+        frames.emplace_back((const uint8_t*)body.data() + offset, size);
+        offset += size;
     }
-#endif // TRACING
+    if (frames.size() != count || offset != body.size())
+    {
+        res.status = 400;
+        res.set_content("Invalid batch", "text/plain");
+        printf("[c2] invalid batch framing!\n");
+        return;
+    }
+    printf("[c2] executing batch of %u payloads\n", count);
+
+    struct Slot
+    {
+        std::shared_ptr<Execution> execution;
+        std::string                output;
+        BatchResult                result = {};
+    };
+    std::vector<Slot> slots(count);
+    auto              fail = [&](uint32_t index, int status, const char* error)
+    {
+        auto& slot         = slots[index];
+        slot.result.status = status;
+        slot.output        = error;
+        slot.execution.reset();
+    };
+
+    // Finished guests hand back their memory right away, only the output is kept
+    std::deque<uint32_t> running;
+    auto                 retire = [&]
+    {
+        auto index = running.front();
+        running.pop_front();
+        auto& slot      = slots[index];
+        auto& execution = *slot.execution;
+        execution.done.wait();
+        switch (execution.task.status)
+        {
+        case riscvm_status_budget:
+            fail(index, 504, "Instruction budget exhausted");
+            break;
+        case riscvm_status_fault:
+            fail(index, 500, "Guest fault");
+            break;
+        default:
+            slot.result.status    = 200;
+            slot.result.exit_code = (int32_t)execution.vm.regs[reg_a0];
+            slot.execution.reset();
+            break;
+        }
+    };
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        auto code      = frames[i].first + 4;
+        auto code_size = frames[i].second - 4;
+        g_metrics.request(frames[i].second);
+        if (frames[i].second < 0x10 || memcmp(frames[i].first, "RV64", 4) != 0)
+        {
+            fail(i, 400, "Invalid RV64 code");
+            continue;
+        }
+#ifdef PAGED_MEMORY
+        if (code_size > RISCVM_PAGED_SIZE / 2)
+#else
+        if (code_size > ArenaPool::max_size())
+#endif // PAGED_MEMORY
+        {
+            fail(i, 413, "RV64 code too big");
+            continue;
+        }
+
+        // Wait for our own guests when the window or the server is full, give up if none are left
+        if (running.size() >= C2_BATCH_WINDOW)
+        {
+            retire();
+        }
+        auto& slot       = slots[i];
+        slot.execution   = std::make_shared<Execution>(slot.output, SIZE_MAX);
+        auto& guest_slot = slot.execution->slot;
+        guest_slot       = std::move(admission);
+        auto  reserved   = guest_slot.acquire();
+        while (!reserved && !running.empty())
+        {
+            retire();
+            reserved = guest_slot.acquire();
+        }
+        if (!reserved)
+        {
+            fail(i, 503, "Server busy");
+            continue;
+        }
+#ifndef PAGED_MEMORY
+        auto& arena = slot.execution->arena;
+        if (!g_arena_pool.acquire(code_size, arena))
+        {
+            fail(i, 500, "Failed to allocate guest memory");
+            continue;
+        }
+        memcpy(arena.code, code, code_size);
+        arena.used = code_size;
+#endif // PAGED_MEMORY
 
-    auto response = "epoch:" + std::to_string(time(nullptr)) + "\n";
-    response += "status:" + std::to_string(status) + "\n";
-    response += "data:" + g_response_data + "\n";
-    res.set_content(response, "text/plain");
+        int         status = 0;
+        const char* error  = nullptr;
+        if (!load_execution(*slot.execution, code, code_size, fnv1a(FNV_OFFSET_BASIS, code, code_size), status, error))
+        {
+            fail(i, status, error);
+            continue;
+        }
 
-    printf("[c2] riscvm_run returned exit code %d\n", status);
+        if (!spawn_execution(*slot.execution))
+        {
+            fail(i, 503, "Server busy");
+            continue;
+        }
+        running.push_back(i);
+    }
+    while (!running.empty())
+    {
+        retire();
+    }
+
+    std::string response("RVB1", 4);
+    response.append((const char*)&count, sizeof(count));
+    for (auto& slot : slots)
+    {
+        slot.result.size = (uint32_t)slot.output.size();
+        response.append((const char*)&slot.result, sizeof(slot.result));
+        response += slot.output;
+    }
+    res.set_content(response, "application/octet-stream");
 }
 
 #define HOST "127.0.0.1"
@@ -137,7 +1192,17 @@ int main(int argc, char** argv)
 #ifdef TRACING
     g_trace = true;
 #endif // TRACING
+    size_t           threads = std::max(1u, std::thread::hardware_concurrency());
+    riscvm_scheduler scheduler(threads, C2_BLOCKING_THREADS);
+    g_scheduler  = &scheduler;
+    g_max_guests = threads * C2_GUESTS_PER_THREAD;
+
+    // Admitted requests hold at most g_max_guests workers, the others are left for /ping and rejections.
+    // An idle keep-alive connection holds a worker as well, so those are closed quickly.
     httplib::Server svr;
+    svr.new_task_queue = [] { return new httplib::ThreadPool(g_max_guests + C2_SPARE_WORKERS); };
+    svr.set_keep_alive_timeout(C2_KEEP_ALIVE_SECONDS);
+    svr.set_keep_alive_max_count(C2_KEEP_ALIVE_REQUESTS);
     svr.Get(
         "/ping",
         [](const httplib::Request& req, httplib::Response& res)
@@ -148,8 +1213,27 @@ int main(int argc, char** argv)
             res.set_content("pong:" + std::to_string(epoch), "text/plain");
         }
     );
+    svr.Get(
+        "/metrics",
+        [](const httplib::Request&, httplib::Response& res)
+        {
+            auto metrics = g_metrics.render();
+            metrics += "# HELP c2_guests_active Guests that are running, runnable or parked.\n";
+            metrics += "# TYPE c2_guests_active gauge\n";
+            metrics += "c2_guests_active " + std::to_string(g_scheduler->active()) + "\n";
+            metrics += "# HELP c2_guests_queued Runnable guests waiting for a scheduler thread.\n";
+            metrics += "# TYPE c2_guests_queued gauge\n";
+            metrics += "c2_guests_queued " + std::to_string(g_scheduler->queued()) + "\n";
+            metrics += "# HELP c2_guests_max Guests that can be active before requests are rejected.\n";
+            metrics += "# TYPE c2_guests_max gauge\n";
+            metrics += "c2_guests_max " + std::to_string(g_max_guests) + "\n";
+            res.set_content(metrics, "text/plain; version=0.0.4");
+        }
+    );
     // curl -X POST -d @payload.bin http://127.0.0.1:13337
     svr.Post("/riscvm", handle_riscvm);
+    svr.Post("/riscvm/batch", handle_batch);
+    svr.set_logger([](const httplib::Request&, const httplib::Response& res) { g_metrics.response(res.status); });
     printf("[c2] starting server on %s:%d\n", HOST, PORT);
     if (!svr.listen(HOST, PORT))
     {
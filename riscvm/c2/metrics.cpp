@@ -0,0 +1,249 @@
+#include "metrics.h"
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+Metrics g_metrics;
+
+// Only the owning thread writes, so there is no need for a locked read-modify-write
+static void bump(std::atomic<uint64_t>& counter, uint64_t value = 1)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+static uint64_t size_bound(size_t bucket)
+{
+    return 256ull << (2 * bucket);
+}
+
+static uint64_t latency_bound_us(size_t bucket)
+{
+    return 64ull << bucket;
+}
+
+Metrics::Counters& Metrics::local()
+{
+    static thread_local Counters* t_counters = nullptr;
+    if (t_counters == nullptr)
+    {
+        // Counters outlive their thread, what a thread counted is never lost
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_threads.push_back(std::make_unique<Counters>());
+        t_counters = m_threads.back().get();
+    }
+    return *t_counters;
+}
+
+void Metrics::request(size_t payload_size)
+{
+    auto&  counters = local();
+    size_t bucket   = 0;
+    while (bucket < METRICS_SIZE_BUCKETS - 1 && payload_size > size_bound(bucket))
+    {
+        bucket++;
+    }
+    bump(counters.requests);
+    bump(counters.payload_bytes[bucket]);
+    bump(counters.payload_bytes_sum, payload_size);
+}
+
+void Metrics::response(int status)
+{
+    if (status >= 0 && status < METRICS_STATUS_CODES)
+    {
+        bump(local().responses[status]);
+    }
+}
+
+void Metrics::execution(uint64_t instructions, uint64_t latency_us)
+{
+    auto&  counters = local();
+    size_t bucket   = 0;
+    while (bucket < METRICS_LATENCY_BUCKETS - 1 && latency_us > latency_bound_us(bucket))
+    {
+        bucket++;
+    }
+    bump(counters.executions);
+    bump(counters.instructions, instructions);
+    bump(counters.latency[bucket]);
+    bump(counters.latency_sum_us, latency_us);
+}
+
+void Metrics::syscall(uint64_t code)
+{
+    size_t slot = METRICS_SYSCALL_SLOTS - 1;
+    if (code < METRICS_SYSCALL_RANGE)
+    {
+        slot = code;
+    }
+    else if (code - 10000 < METRICS_SYSCALL_RANGE)
+    {
+        slot = METRICS_SYSCALL_RANGE + code - 10000;
+    }
+    else if (code - 20000 < METRICS_SYSCALL_RANGE)
+    {
+        slot = 2 * METRICS_SYSCALL_RANGE + code - 20000;
+    }
+    bump(local().syscalls[slot]);
+}
+
+static void append(std::string& out, const char* format, ...)
+{
+    char    line[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    out += line;
+}
+
+std::string Metrics::render()
+{
+    Counters total;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto                        add = [](std::atomic<uint64_t>& sum, const std::atomic<uint64_t>& value)
+        {
+            sum.store(sum.load(std::memory_order_relaxed) + value.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        };
+        for (auto& counters : m_threads)
+        {
+            add(total.requests, counters->requests);
+            add(total.payload_bytes_sum, counters->payload_bytes_sum);
+            add(total.executions, counters->executions);
+            add(total.instructions, counters->instructions);
+            add(total.latency_sum_us, counters->latency_sum_us);
+            for (size_t i = 0; i < METRICS_STATUS_CODES; i++)
+            {
+                add(total.responses[i], counters->responses[i]);
+            }
+            for (size_t i = 0; i < METRICS_SIZE_BUCKETS; i++)
+            {
+                add(total.payload_bytes[i], counters->payload_bytes[i]);
+            }
+            for (size_t i = 0; i < METRICS_LATENCY_BUCKETS; i++)
+            {
+                add(total.latency[i], counters->latency[i]);
+            }
+            for (size_t i = 0; i < METRICS_SYSCALL_SLOTS; i++)
+            {
+                add(total.syscalls[i], counters->syscalls[i]);
+            }
+        }
+    }
+
+    std::string out;
+    out += "# HELP c2_riscvm_requests_total Payloads submitted for execution.\n";
+    out += "# TYPE c2_riscvm_requests_total counter\n";
+    append(out, "c2_riscvm_requests_total %" PRIu64 "\n", total.requests.load());
+
+    out += "# HELP c2_http_responses_total HTTP responses by status code.\n";
+    out += "# TYPE c2_http_responses_total counter\n";
+    for (size_t i = 0; i < METRICS_STATUS_CODES; i++)
+    {
+        if (auto count = total.responses[i].load())
+        {
+            append(out, "c2_http_responses_total{code=\"%zu\"} %" PRIu64 "\n", i, count);
+        }
+    }
+
+    out += "# HELP c2_payload_bytes Size of the submitted payloads.\n";
+    out += "# TYPE c2_payload_bytes histogram\n";
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < METRICS_SIZE_BUCKETS; i++)
+    {
+        cumulative += total.payload_bytes[i].load();
+        if (i < METRICS_SIZE_BUCKETS - 1)
+        {
+            append(out, "c2_payload_bytes_bucket{le=\"%" PRIu64 "\"} %" PRIu64 "\n", size_bound(i), cumulative);
+        }
+        else
+        {
+            append(out, "c2_payload_bytes_bucket{le=\"+Inf\"} %" PRIu64 "\n", cumulative);
+        }
+    }
+    append(out, "c2_payload_bytes_sum %" PRIu64 "\n", total.payload_bytes_sum.load());
+    append(out, "c2_payload_bytes_count %" PRIu64 "\n", cumulative);
+
+    out += "# HELP c2_guest_instructions_total Guest instructions retired.\n";
+    out += "# TYPE c2_guest_instructions_total counter\n";
+    append(out, "c2_guest_instructions_total %" PRIu64 "\n", total.instructions.load());
+
+    out += "# HELP c2_execution_seconds Time from scheduling a guest until it is done.\n";
+    out += "# TYPE c2_execution_seconds histogram\n";
+    auto executions = total.executions.load();
+    auto latency_s  = total.latency_sum_us.load() / 1e6;
+    cumulative      = 0;
+    for (size_t i = 0; i < METRICS_LATENCY_BUCKETS; i++)
+    {
+        cumulative += total.latency[i].load();
+        if (i < METRICS_LATENCY_BUCKETS - 1)
+        {
+            append(out, "c2_execution_seconds_bucket{le=\"%g\"} %" PRIu64 "\n", latency_bound_us(i) / 1e6, cumulative);
+        }
+        else
+        {
+            append(out, "c2_execution_seconds_bucket{le=\"+Inf\"} %" PRIu64 "\n", cumulative);
+        }
+    }
+    append(out, "c2_execution_seconds_sum %g\n", latency_s);
+    append(out, "c2_execution_seconds_count %" PRIu64 "\n", executions);
+
+    // Estimated from the histogram, interpolating within the bucket like histogram_quantile
+    out += "# HELP c2_execution_latency_seconds Execution latency percentiles.\n";
+    out += "# TYPE c2_execution_latency_seconds summary\n";
+    for (auto quantile : {0.5, 0.9, 0.99})
+    {
+        double value = 0;
+        if (executions > 0)
+        {
+            double   rank  = quantile * executions;
+            uint64_t below = 0;
+            for (size_t i = 0; i < METRICS_LATENCY_BUCKETS; i++)
+            {
+                auto count = total.latency[i].load();
+                if (below + count >= rank && count > 0)
+                {
+                    if (i == METRICS_LATENCY_BUCKETS - 1)
+                    {
+                        value = latency_bound_us(i - 1) / 1e6;
+                    }
+                    else
+                    {
+                        double lower = i == 0 ? 0 : latency_bound_us(i - 1);
+                        double upper = latency_bound_us(i);
+                        value        = (lower + (upper - lower) * (rank - below) / count) / 1e6;
+                    }
+                    break;
+                }
+                below += count;
+            }
+        }
+        append(out, "c2_execution_latency_seconds{quantile=\"%g\"} %g\n", quantile, value);
+    }
+    append(out, "c2_execution_latency_seconds_sum %g\n", latency_s);
+    append(out, "c2_execution_latency_seconds_count %" PRIu64 "\n", executions);
+
+    out += "# HELP c2_syscalls_total System calls made by guests, by number.\n";
+    out += "# TYPE c2_syscalls_total counter\n";
+    for (size_t i = 0; i < METRICS_SYSCALL_SLOTS; i++)
+    {
+        auto count = total.syscalls[i].load();
+        if (count == 0)
+        {
+            continue;
+        }
+        if (i == METRICS_SYSCALL_SLOTS - 1)
+        {
+            append(out, "c2_syscalls_total{code=\"other\"} %" PRIu64 "\n", count);
+        }
+        else
+        {
+            static const size_t bases[] = {0, 10000, 20000};
+            auto                code    = bases[i / METRICS_SYSCALL_RANGE] + i % METRICS_SYSCALL_RANGE;
+            append(out, "c2_syscalls_total{code=\"%zu\"} %" PRIu64 "\n", code, count);
+        }
+    }
+    return out;
+}
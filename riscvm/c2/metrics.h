@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Payload sizes in powers of four from 256 bytes, the last bucket is +Inf
+#define METRICS_SIZE_BUCKETS 10
+// Execution latency in powers of two from 64us (~16s in the last finite bucket)
+#define METRICS_LATENCY_BUCKETS 20
+// HTTP status codes are counted up to 599
+#define METRICS_STATUS_CODES 600
+// System calls 0-255 (linux), 10000-10255 (riscvm) and 20000-20255 (host), plus everything else
+#define METRICS_SYSCALL_RANGE 256
+#define METRICS_SYSCALL_SLOTS (3 * METRICS_SYSCALL_RANGE + 1)
+
+/*
+ * Counters for the /metrics endpoint. Every thread only ever writes to its
+ * own set of counters, so they are bumped with plain relaxed loads and
+ * stores. A scrape adds up the sets of all threads that ever recorded
+ * something, which is why there is a single global instance.
+ */
+class Metrics
+{
+    struct Counters
+    {
+        std::atomic<uint64_t> requests{0};
+        std::atomic<uint64_t> responses[METRICS_STATUS_CODES] = {};
+        std::atomic<uint64_t> payload_bytes[METRICS_SIZE_BUCKETS] = {};
+        std::atomic<uint64_t> payload_bytes_sum{0};
+        std::atomic<uint64_t> executions{0};
+        std::atomic<uint64_t> instructions{0};
+        std::atomic<uint64_t> latency[METRICS_LATENCY_BUCKETS] = {};
+        std::atomic<uint64_t> latency_sum_us{0};
+        std::atomic<uint64_t> syscalls[METRICS_SYSCALL_SLOTS] = {};
+    };
+
+    std::mutex                             m_mutex;
+    std::vector<std::unique_ptr<Counters>> m_threads;
+
+  public:
+    Metrics()                          = default;
+    Metrics(const Metrics&)            = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+    void request(size_t payload_size);
+    void response(int status);
+    void execution(uint64_t instructions, uint64_t latency_us);
+    void syscall(uint64_t code);
+
+    // Prometheus text exposition format of everything recorded so far
+    std::string render();
+
+  private:
+    Counters& local();
+};
+
+extern Metrics g_metrics;
@@ -134,6 +134,26 @@ def shuffle_operands(instruction, shuffled, opcodes):
     instruction = replace_opcode(instruction, shuffled["rv64_opcodes"])
     return instruction
 
+def encode_opcode_map(shuffle_map):
+    """
+    Encodes the decoding tables (shuffled -> original) so the host can load them at runtime.
+    Layout matches riscvm_encoded_map in riscvm.h, unused entries are 0xFF (0xFFFF for op64/op32).
+    """
+    def decode_table(name, size, fmt):
+        table = [0xFFFF if fmt == "H" else 0xFF] * size
+        for original, shuffled in shuffle_map[name].items():
+            assert shuffled < size, f"Shuffled value {shuffled} out of range for {name}"
+            table[shuffled] = original
+        return struct.pack(f"<{size}{fmt}", *table)
+
+    data = decode_table("rv64_opcodes", 32, "B")
+    for name in ["rv64_imm64", "rv64_imm32", "rv64_load", "rv64_store", "rv64_branch"]:
+        data += decode_table(name, 8, "B")
+    for name in ["rv64_op64", "rv64_op32"]:
+        data += decode_table(name, 32, "H")
+    assert len(data) == 200
+    return data
+
 def main():
     parser = argparse.ArgumentParser()
     parser.add_argument("input", help="Input RISC-V binary")
@@ -235,12 +255,16 @@ def main():
         rela_offset += 13
     assert rela_offset + 1 == len(binary), "Incorrect relocation format"
 
+    # Append the opcode map (directly in front of the feature section)
+    if shuffle:
+        binary += encode_opcode_map(shuffle_map)
+
     # Append the feature section
     features = 0
     if encrypt:
         features |= 1
     if shuffle:
-        features |= 2
+        features |= 2 | 4
     binary += b"FEAT"
     binary += struct.pack("<BI", features, key)
 
@@ -1,5 +1,7 @@
 from elftools.elf.elffile import ELFFile
 from elftools.elf.sections import SymbolTableSection
+from encrypt import encode_opcode_map
+import json
 import os
 
 def parse_test_elf(file):
@@ -60,6 +62,24 @@ def main():
     with open("isa-tests/data.h", "wb") as f:
         f.write(code.encode("utf-8"))
 
+    # The tests also run shuffled with shuffled_opcodes.json, the same map encrypt.py embeds in payloads
+    with open("shuffled_opcodes.json", "r") as f:
+        shuffle_map = json.load(f)
+        shuffle_map = {k: {int(k2): v2 for k2, v2 in v.items()} for k, v in shuffle_map.items()}
+    encoded = encode_opcode_map(shuffle_map)
+    code = "#pragma once\n\n"
+    code += "#include <stdint.h>\n\n"
+    code += "// riscvm_encoded_map of shuffled_opcodes.json\n"
+    code += "static const uint8_t shuffled_opcode_map[] = {\n"
+    for i, byte in enumerate(encoded):
+        code += f"0x{byte:02x}, "
+        if i % 16 == 15:
+            code += "\n"
+    code += "\n};\n"
+
+    with open("isa-tests/shuffled.h", "wb") as f:
+        f.write(code.encode("utf-8"))
+
 
 if __name__ == "__main__":
     main()
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+
+// riscvm_encoded_map of shuffled_opcodes.json
+static const uint8_t shuffled_opcode_map[] = {
+0x06, 0x0d, 0x1b, 0x0e, 0x1c, 0x03, 0x0c, 0x04, 0x00, 0x08, 0x19, 0x05, 0x18, 0xff, 0xff, 0xff, 
+0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 
+0x06, 0x02, 0x04, 0x01, 0x07, 0x03, 0x00, 0x05, 0x05, 0x01, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 
+0x02, 0x06, 0x00, 0x03, 0x04, 0x01, 0x05, 0xff, 0x01, 0x02, 0x03, 0x00, 0xff, 0xff, 0xff, 0xff, 
+0x01, 0x00, 0x07, 0x04, 0x05, 0x06, 0xff, 0xff, 0x0a, 0x00, 0x05, 0x00, 0x07, 0x00, 0x00, 0x01, 
+0x0d, 0x00, 0x04, 0x00, 0x09, 0x00, 0x03, 0x00, 0x02, 0x00, 0x08, 0x00, 0x0f, 0x00, 0x06, 0x00, 
+0x0b, 0x00, 0x0c, 0x00, 0x05, 0x01, 0x01, 0x00, 0x0e, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 
+0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 
+0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x0f, 0x00, 0x05, 0x01, 0x05, 0x00, 
+0x01, 0x00, 0x0e, 0x00, 0x0c, 0x00, 0x00, 0x01, 0x0d, 0x00, 0x08, 0x00, 0xff, 0xff, 0xff, 0xff, 
+0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 
+0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 
+0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 
+};
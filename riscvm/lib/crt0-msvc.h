@@ -1,5 +1,7 @@
 #pragma once
 
+#include "exports.h"
+
 uintptr_t riscvm_host_call(uintptr_t address, uintptr_t args[13])
 {
     register uintptr_t a0 asm("a0") = address;
@@ -17,6 +19,25 @@ uintptr_t riscvm_get_peb()
     return a0;
 }
 
+// Import addresses the host remembers across guest runs, 0 when not cached (RISCVM_FEATURE_IMPORT_CACHE only)
+uintptr_t riscvm_import_cache_get(uintptr_t image, uint32_t export_hash)
+{
+    register uintptr_t a0 asm("a0") = image;
+    register uintptr_t a1 asm("a1") = export_hash;
+    register uintptr_t a7 asm("a7") = 20002;
+    asm volatile("scall" : "+r"(a0) : "r"(a1), "r"(a7));
+    return a0;
+}
+
+void riscvm_import_cache_set(uintptr_t image, uint32_t export_hash, uintptr_t address)
+{
+    register uintptr_t a0 asm("a0") = image;
+    register uintptr_t a1 asm("a1") = export_hash;
+    register uintptr_t a2 asm("a2") = address;
+    register uintptr_t a7 asm("a7") = 20003;
+    asm volatile("scall" : "+r"(a0) : "r"(a1), "r"(a2), "r"(a7));
+}
+
 typedef struct _LIST_ENTRY
 {
     struct _LIST_ENTRY* Flink;
@@ -143,18 +164,6 @@ uintptr_t riscvm_resolve_dll(uint32_t module_hash)
     return 0;
 }
 
-// x65599 (case sensitive)
-__attribute__((always_inline)) static uint32_t hash_import(const char* buffer)
-{
-    uint32_t hash = 0;
-    for (; *buffer != '\0'; buffer++)
-    {
-        char ch = *buffer;
-        hash    = ch + 65599 * hash;
-    }
-    return hash;
-}
-
 #pragma pack(push, 1)
 typedef struct _IMAGE_DOS_HEADER
 {                        // DOS .EXE header
@@ -289,32 +298,109 @@ typedef struct _IMAGE_NT_HEADERS
 } IMAGE_NT_HEADERS;
 #pragma pack(pop)
 
-uintptr_t riscvm_resolve_import(uintptr_t image, uint32_t export_hash)
+// Modules that get an export index, imports from any others fall back to a linear scan
+#define RISCVM_EXPORT_INDEX_MODULES 16
+
+#define HASH_KERNEL32_DLL 0x536CD652 // hash_module(L"kernel32.dll")
+#define HASH_VIRTUALALLOC 0x39D1A64A // riscvm_exports_hash("VirtualAlloc")
+#define HASH_VIRTUALFREE  0xFAF2DF57 // riscvm_exports_hash("VirtualFree")
+
+static struct
 {
-    IMAGE_DOS_HEADER*       dos_header      = (IMAGE_DOS_HEADER*)image;
-    IMAGE_NT_HEADERS*       nt_headers      = (IMAGE_NT_HEADERS*)(image + dos_header->e_lfanew);
-    uint32_t                export_dir_size = nt_headers->OptionalHeader.DataDirectory[0].Size;
-    IMAGE_EXPORT_DIRECTORY* export_dir =
-        (IMAGE_EXPORT_DIRECTORY*)(image + nt_headers->OptionalHeader.DataDirectory[0].VirtualAddress);
-    uint32_t* names = (uint32_t*)(image + export_dir->AddressOfNames);
-    uint32_t* funcs = (uint32_t*)(image + export_dir->AddressOfFunctions);
-    uint16_t* ords  = (uint16_t*)(image + export_dir->AddressOfNameOrdinals);
-
-    for (uint32_t i = 0; i < export_dir->NumberOfNames; ++i)
+    uintptr_t image;
+    uint64_t* index;
+} g_export_indices[RISCVM_EXPORT_INDEX_MODULES];
+
+// Resolved once, (uintptr_t)-1 when either is missing and there are no indices
+static uintptr_t g_virtual_alloc;
+static uintptr_t g_virtual_free;
+
+// Index for the module, built (and allocated on the host) when it is first used, released by riscvm_fini
+static uint64_t* riscvm_export_index(const riscvm_exports* exports)
+{
+    size_t slot = 0;
+    for (; slot < RISCVM_EXPORT_INDEX_MODULES && g_export_indices[slot].image != 0; slot++)
     {
-        char*     name = (char*)(image + names[i]);
-        uintptr_t func = (uintptr_t)(image + funcs[ords[i]]);
-        // Ignore forwarded exports (TODO: handle properly?)
-        if (func >= (uintptr_t)export_dir && func < (uintptr_t)export_dir + export_dir_size)
-            continue;
-        uint32_t hash = hash_import(name);
-        if (hash == export_hash)
+        if (g_export_indices[slot].image == exports->image)
         {
-            return func;
+            return g_export_indices[slot].index;
         }
     }
+    if (slot == RISCVM_EXPORT_INDEX_MODULES || exports->count == 0)
+    {
+        return 0;
+    }
 
-    return 0;
+    // Bootstrapping with the linear scans of kernel32 that are unavoidable
+    if (g_virtual_alloc == 0)
+    {
+        riscvm_exports kernel32;
+        riscvm_exports_init(&kernel32, riscvm_resolve_dll(HASH_KERNEL32_DLL));
+        g_virtual_alloc = riscvm_exports_scan_hash(&kernel32, HASH_VIRTUALALLOC);
+        g_virtual_free  = riscvm_exports_scan_hash(&kernel32, HASH_VIRTUALFREE);
+        if (g_virtual_alloc == 0 || g_virtual_free == 0)
+        {
+            g_virtual_alloc = (uintptr_t)-1;
+        }
+    }
+    if (g_virtual_alloc == (uintptr_t)-1)
+    {
+        return 0;
+    }
+
+    // VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE)
+    uintptr_t args[13] = {0, exports->count * sizeof(uint64_t), 0x3000, 0x04};
+    uint64_t* index    = (uint64_t*)riscvm_host_call(g_virtual_alloc, args);
+    if (index == 0)
+    {
+        return 0;
+    }
+    riscvm_exports_build_index(exports, index);
+
+    g_export_indices[slot].image = exports->image;
+    g_export_indices[slot].index = index;
+    return index;
+}
+
+// Called by _start after main returns, a guest the host stops before that leaks its indices
+static void riscvm_fini()
+{
+    for (size_t slot = 0; slot < RISCVM_EXPORT_INDEX_MODULES && g_export_indices[slot].image != 0; slot++)
+    {
+        // VirtualFree(index, 0, MEM_RELEASE)
+        uintptr_t args[13] = {(uintptr_t)g_export_indices[slot].index, 0, 0x8000};
+        riscvm_host_call(g_virtual_free, args);
+        g_export_indices[slot].image = 0;
+        g_export_indices[slot].index = 0;
+    }
+}
+
+uintptr_t riscvm_resolve_import(uintptr_t image, uint32_t export_hash)
+{
+    bool      cached  = (g_host_features & RISCVM_FEATURE_IMPORT_CACHE) != 0;
+    uintptr_t address = cached ? riscvm_import_cache_get(image, export_hash) : 0;
+    if (address != 0)
+    {
+        return address;
+    }
+
+    riscvm_exports exports;
+    riscvm_exports_init(&exports, image);
+
+    uint64_t* index = riscvm_export_index(&exports);
+    if (index != 0)
+    {
+        address = riscvm_exports_find_hash(&exports, index, export_hash);
+    }
+    else
+    {
+        address = riscvm_exports_scan_hash(&exports, export_hash);
+    }
+    if (address != 0 && cached)
+    {
+        riscvm_import_cache_set(image, export_hash, address);
+    }
+    return address;
 }
 
 // https://learn.microsoft.com/en-us/cpp/c-runtime-library/reference/invalid-parameter-functions
@@ -2,15 +2,30 @@ static void exit(int exit_code);
 static void riscvm_relocs();
 void        riscvm_imports() __attribute__((weak));
 static void riscvm_init_arrays();
+static void riscvm_fini();
 extern int __attribute((noinline)) main();
 
+// RISCVM_FEATURES_MAGIC and RISCVM_FEATURE_* in riscvm.h
+#define RISCVM_FEATURES_MAGIC       0x5256464500000000ull
+#define RISCVM_FEATURE_IMPORT_CACHE 0x1
+
+// Optional system calls the host implements, none unless it passed them in a0
+static unsigned int g_host_features;
+
 // NOTE: This function has to be first in the file
-void _start()
+void _start(unsigned long long host_features)
 {
+    if ((host_features & 0xFFFFFFFF00000000ull) == RISCVM_FEATURES_MAGIC)
+    {
+        g_host_features = (unsigned int)host_features;
+    }
     riscvm_relocs();
+    // Before any code that can call an import, inlined import stubs load the address as invariant
     riscvm_imports();
     riscvm_init_arrays();
-    exit(main());
+    int exit_code = main();
+    riscvm_fini();
+    exit(exit_code);
     asm volatile("ebreak");
 }
 
@@ -39,9 +54,12 @@ extern uint8_t __relocs_start[];
 #define R_RISCV_NONE 0
 #define R_RISCV_64   2
 
+// "RELA" as written by relocs.py
+#define RELOCS_MAGIC 0x414C4552
+
 static __attribute((noinline)) void riscvm_relocs()
 {
-    if (*(uint32_t*)__relocs_start != 'ALER')
+    if (*(uint32_t*)__relocs_start != RELOCS_MAGIC)
     {
         asm volatile("ebreak");
     }
@@ -123,4 +141,8 @@ void* memmove(void* dest, const void* src, uintptr_t count)
 
 #ifdef CRT0_MSVC
 #include "crt0-msvc.h"
+#else
+static void riscvm_fini()
+{
+}
 #endif // CRT0_MSVC
@@ -0,0 +1,195 @@
+#pragma once
+
+/*
+ * PE export table lookups for guest code. Walking the export table means
+ * hashing or comparing export names in the interpreter, so everything here
+ * avoids touching more names than necessary: lookups by name binary search
+ * the (lexically sorted) name table and lookups by hash go through an index
+ * sorted by hash. This is plain C without system calls, so the host tests
+ * can run it against a synthetic image.
+ */
+
+#include <stdint.h>
+
+#define RISCVM_EXPORT_NOT_FOUND 0xFFFFFFFFu
+
+typedef struct riscvm_exports
+{
+    uintptr_t       image;
+    const uint32_t* names; // name RVAs, sorted lexically by the linker
+    const uint32_t* functions;
+    const uint16_t* ordinals;
+    uint32_t        count; // number of names
+    uintptr_t       directory;
+    uint32_t        directory_size; // forwarded exports point inside the directory
+} riscvm_exports;
+
+static inline void riscvm_exports_init(riscvm_exports* exports, uintptr_t image)
+{
+    // IMAGE_DOS_HEADER::e_lfanew and IMAGE_NT_HEADERS64::OptionalHeader.DataDirectory[0]
+    uint32_t        nt_headers     = *(const uint32_t*)(image + 0x3C);
+    const uint32_t* data_directory = (const uint32_t*)(image + nt_headers + 0x88);
+    // IMAGE_EXPORT_DIRECTORY::NumberOfNames and the three arrays following it
+    const uint32_t* export_dir = (const uint32_t*)(image + data_directory[0]);
+
+    exports->image          = image;
+    exports->count          = export_dir[6];
+    exports->functions      = (const uint32_t*)(image + export_dir[7]);
+    exports->names          = (const uint32_t*)(image + export_dir[8]);
+    exports->ordinals       = (const uint16_t*)(image + export_dir[9]);
+    exports->directory      = (uintptr_t)export_dir;
+    exports->directory_size = data_directory[1];
+}
+
+static inline const char* riscvm_exports_name(const riscvm_exports* exports, uint32_t index)
+{
+    return (const char*)(exports->image + exports->names[index]);
+}
+
+// Address of the export with the given name index. Forwarded exports point at a "DLL.Name"
+// string in the export directory instead of code, they are 0 and have to be imported from
+// the DLL they forward to.
+static inline uintptr_t riscvm_exports_function(const riscvm_exports* exports, uint32_t index)
+{
+    uintptr_t function = exports->image + exports->functions[exports->ordinals[index]];
+    if (function >= exports->directory && function < exports->directory + exports->directory_size)
+    {
+        return 0;
+    }
+    return function;
+}
+
+// x65599 (case sensitive), must match hash_import in the transpiler
+static inline uint32_t riscvm_exports_hash(const char* buffer)
+{
+    uint32_t hash = 0;
+    for (; *buffer != '\0'; buffer++)
+    {
+        char ch = *buffer;
+        hash    = ch + 65599 * hash;
+    }
+    return hash;
+}
+
+// Name index of an export, or RISCVM_EXPORT_NOT_FOUND
+static inline uint32_t riscvm_exports_find_name(const riscvm_exports* exports, const char* name)
+{
+    uint32_t low  = 0;
+    uint32_t high = exports->count;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+
+        // strcmp order, stops at the first differing character
+        const uint8_t* a = (const uint8_t*)riscvm_exports_name(exports, mid);
+        const uint8_t* b = (const uint8_t*)name;
+        while (*a != '\0' && *a == *b)
+        {
+            a++;
+            b++;
+        }
+
+        if (*a == *b)
+        {
+            return mid;
+        }
+        if (*a < *b)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return RISCVM_EXPORT_NOT_FOUND;
+}
+
+// Linear scan hashing every name, for when there is no index
+static inline uintptr_t riscvm_exports_scan_hash(const riscvm_exports* exports, uint32_t hash)
+{
+    for (uint32_t i = 0; i < exports->count; i++)
+    {
+        uintptr_t function = riscvm_exports_function(exports, i);
+        if (function != 0 && riscvm_exports_hash(riscvm_exports_name(exports, i)) == hash)
+        {
+            return function;
+        }
+    }
+    return 0;
+}
+
+static inline void riscvm_exports_sift_down(uint64_t* index, uint32_t root, uint32_t end)
+{
+    for (uint32_t child; (child = 2 * root + 1) < end; root = child)
+    {
+        if (child + 1 < end && index[child + 1] > index[child])
+        {
+            child++;
+        }
+        if (index[root] >= index[child])
+        {
+            break;
+        }
+        uint64_t temp = index[root];
+        index[root]   = index[child];
+        index[child]  = temp;
+    }
+}
+
+/*
+ * Fills index (exports->count entries) with hash << 32 | name index, sorted.
+ * Every name is hashed exactly once, after which riscvm_exports_find_hash
+ * only needs a binary search.
+ */
+static inline void riscvm_exports_build_index(const riscvm_exports* exports, uint64_t* index)
+{
+    uint32_t count = exports->count;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        index[i] = (uint64_t)riscvm_exports_hash(riscvm_exports_name(exports, i)) << 32 | i;
+    }
+
+    // Heapsort: in place, no recursion and no quadratic worst case
+    for (uint32_t root = count / 2; root-- > 0;)
+    {
+        riscvm_exports_sift_down(index, root, count);
+    }
+    for (uint32_t end = count; end-- > 1;)
+    {
+        uint64_t temp = index[0];
+        index[0]      = index[end];
+        index[end]    = temp;
+        riscvm_exports_sift_down(index, 0, end);
+    }
+}
+
+// Same result as riscvm_exports_scan_hash: the first non-forwarded export (in name order) with the hash
+static inline uintptr_t riscvm_exports_find_hash(const riscvm_exports* exports, const uint64_t* index, uint32_t hash)
+{
+    uint64_t key  = (uint64_t)hash << 32;
+    uint32_t low  = 0;
+    uint32_t high = exports->count;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        if (index[mid] < key)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    for (; low < exports->count && (uint32_t)(index[low] >> 32) == hash; low++)
+    {
+        uintptr_t function = riscvm_exports_function(exports, (uint32_t)index[low]);
+        if (function != 0)
+        {
+            return function;
+        }
+    }
+    return 0;
+}
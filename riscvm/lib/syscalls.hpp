@@ -24,6 +24,9 @@ enum class e_syscall : uint32_t
 
     host_call = 20000,
     get_peb = 20001,
+    import_cache_get = 20002,
+    import_cache_set = 20003,
+    host_call_regs = 20004,
 };
 
 namespace detail
@@ -1,5 +1,6 @@
 #pragma once
 #include "common.hpp"
+#include "exports.h"
 #include "syscalls.hpp"
 
 // ty magic <3
@@ -201,50 +202,20 @@ namespace win
 {
 namespace detail
 {
-// TODO: better hashing algo
-ALWAYS_INLINE_CXND uint32_t hash(const char* str)
-{
-    uint32_t hash = 0x811c9dc5;
-    while (*str)
-    {
-        hash ^= *str++;
-        hash *= 0x1000193;
-    }
-    return hash;
-}
-
-template <auto NameHash> struct syscall_holder
+struct syscall_holder
 {
     uintptr_t func_address;
-
-    ALWAYS_INLINE void init(const char* name, uintptr_t addr)
-    {
-        if (NameHash == hash(name))
-        {
-            func_address = addr;
-        }
-    }
 };
 
-template <class F> ALWAYS_INLINE inline void enum_syscalls(const uintptr_t image, F callback)
+// Binary search of the export name table instead of hashing every name
+ALWAYS_INLINE inline uintptr_t find_export(const riscvm_exports& exports, const char* name)
 {
-    auto dos_header = reinterpret_cast<const IMAGE_DOS_HEADER*>(image);
-    auto nt_headers = reinterpret_cast<const IMAGE_NT_HEADERS*>(image + dos_header->e_lfanew);
-    auto export_dir = reinterpret_cast<const IMAGE_EXPORT_DIRECTORY*>(
-        image + nt_headers->OptionalHeader.DataDirectory[0].VirtualAddress
-    );
-
-    auto names = reinterpret_cast<const uint32_t*>(image + export_dir->AddressOfNames);
-    auto funcs = reinterpret_cast<const uint32_t*>(image + export_dir->AddressOfFunctions);
-    auto ords  = reinterpret_cast<const uint16_t*>(image + export_dir->AddressOfNameOrdinals);
-
-    for (uint32_t i = 0; i < export_dir->NumberOfNames; ++i)
+    auto index = riscvm_exports_find_name(&exports, name);
+    if (index == RISCVM_EXPORT_NOT_FOUND)
     {
-        auto name = reinterpret_cast<const char*>(image + names[i]);
-        auto func = reinterpret_cast<const uintptr_t>(image + funcs[ords[i]]);
-
-        callback(name, func);
+        return 0;
     }
+    return riscvm_exports_function(&exports, index);
 }
 
 ALWAYS_INLINE inline PEB_T* get_peb()
@@ -271,8 +242,8 @@ ALWAYS_INLINE inline uintptr_t find_ntdll(win::PEB_T* peb)
 
 } // namespace win
 
-#define DEFINE_SYSCALL(name)  inline win::detail::syscall_holder<win::detail::hash(#name)> _##name##_holder;
-#define INIT_SYSCALL(syscall) _##syscall##_holder.init(name, func);
+#define DEFINE_SYSCALL(name)  inline win::detail::syscall_holder _##name##_holder;
+#define INIT_SYSCALL(syscall) _##syscall##_holder.func_address = detail::find_export(exports, #syscall);
 
 DEFINE_SYSCALL(ZwQueryInformationProcess);
 DEFINE_SYSCALL(ZwCreateFile);
@@ -284,17 +255,12 @@ namespace win
 
 ALWAYS_INLINE inline void init_syscalls()
 {
-    auto image = find_ntdll(win::detail::get_peb());
-    detail::enum_syscalls(
-        image,
-        [&](const char* name, const uintptr_t func)
-        {
-            INIT_SYSCALL(ZwQueryInformationProcess);
-            INIT_SYSCALL(ZwCreateFile);
-            INIT_SYSCALL(ZwWriteFile);
-            INIT_SYSCALL(ZwClose);
-        }
-    );
+    riscvm_exports exports;
+    riscvm_exports_init(&exports, find_ntdll(win::detail::get_peb()));
+    INIT_SYSCALL(ZwQueryInformationProcess);
+    INIT_SYSCALL(ZwCreateFile);
+    INIT_SYSCALL(ZwWriteFile);
+    INIT_SYSCALL(ZwClose);
 }
 
 namespace detail
@@ -0,0 +1,215 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include "libriscvm.h"
+
+// Runs guest code through the public API only, so it tests the library as a host links it
+struct Guest
+{
+    libriscvm_vm* vm = nullptr;
+
+    ~Guest()
+    {
+        libriscvm_destroy(vm);
+    }
+
+    template <size_t Count> const char* load(const uint32_t (&code)[Count])
+    {
+        vm = libriscvm_create(0x10000);
+        if (vm == nullptr)
+        {
+            return "libriscvm_create failed";
+        }
+        if (libriscvm_load(vm, code, sizeof(code)) != LIBRISCVM_OK)
+        {
+            return "libriscvm_load failed";
+        }
+        return nullptr;
+    }
+};
+
+// li a0, 42; li a7, 10000; ecall
+static const char* test_exit()
+{
+    const uint32_t code[] = {0x02A00513, 0x000028B7, 0x7108889B, 0x00000073};
+
+    Guest guest;
+    if (auto error = guest.load(code))
+    {
+        return error;
+    }
+    if (libriscvm_run(guest.vm, 1000, 0) != LIBRISCVM_STATUS_EXITED)
+    {
+        return "guest did not exit";
+    }
+    if (libriscvm_get_reg(guest.vm, 10) != 42)
+    {
+        return "wrong exit code";
+    }
+    libriscvm_counters counters;
+    libriscvm_get_counters(guest.vm, &counters);
+    if (counters.instructions != 4 || counters.syscalls != 1 || counters.runs != 1)
+    {
+        return "wrong counters";
+    }
+    return nullptr;
+}
+
+// 1: j 1b
+static const char* test_budget()
+{
+    const uint32_t code[] = {0x0000006F};
+
+    Guest guest;
+    if (auto error = guest.load(code))
+    {
+        return error;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        if (libriscvm_run(guest.vm, 100, 0) != LIBRISCVM_STATUS_BUDGET)
+        {
+            return "guest did not run out of budget";
+        }
+    }
+    libriscvm_counters counters;
+    libriscvm_get_counters(guest.vm, &counters);
+    if (counters.instructions != 200 || counters.runs != 2)
+    {
+        return "wrong counters";
+    }
+    return nullptr;
+}
+
+// li a7, 12345; ecall
+static const char* test_fault()
+{
+    const uint32_t code[] = {0x000038B7, 0x0398889B, 0x00000073};
+
+    Guest guest;
+    if (auto error = guest.load(code))
+    {
+        return error;
+    }
+    if (libriscvm_run(guest.vm, 1000, 0) != LIBRISCVM_STATUS_FAULT)
+    {
+        return "unregistered system call did not fault";
+    }
+    return nullptr;
+}
+
+// An all-zero word, the guest faults instead of trapping the host
+static const char* test_illegal()
+{
+    const uint32_t code[] = {0x00000000};
+
+    Guest guest;
+    if (auto error = guest.load(code))
+    {
+        return error;
+    }
+    if (libriscvm_run(guest.vm, 1000, 0) != LIBRISCVM_STATUS_FAULT)
+    {
+        return "illegal instruction did not fault";
+    }
+    return nullptr;
+}
+
+#if defined(SANDBOX_MEMORY) || defined(PAGED_MEMORY)
+// li a7, 20000; ecall (host_call is not available in the sandbox)
+static const char* test_sandbox_host_call()
+{
+    const uint32_t code[] = {0x000058B7, 0xE208889B, 0x00000073};
+
+    Guest guest;
+    if (auto error = guest.load(code))
+    {
+        return error;
+    }
+    if (libriscvm_run(guest.vm, 1000, 0) != LIBRISCVM_STATUS_FAULT)
+    {
+        return "host_call did not fault";
+    }
+    return nullptr;
+}
+#endif // SANDBOX_MEMORY || PAGED_MEMORY
+
+// li a7, 30000; ecall; li a7, 10000; ecall
+static const char* test_yield()
+{
+    const uint32_t code[] = {0x000078B7, 0x5308889B, 0x00000073, 0x000028B7, 0x7108889B, 0x00000073};
+
+    Guest guest;
+    if (auto error = guest.load(code))
+    {
+        return error;
+    }
+    auto handler = [](libriscvm_vm* vm, uint64_t, void*, uint64_t* result)
+    {
+        libriscvm_yield(vm);
+        *result = 7;
+        return 1;
+    };
+    if (libriscvm_register_syscall(guest.vm, 30000, handler, nullptr) != LIBRISCVM_OK)
+    {
+        return "libriscvm_register_syscall failed";
+    }
+    if (libriscvm_run(guest.vm, 1000, 0) != LIBRISCVM_STATUS_YIELD)
+    {
+        return "guest did not yield";
+    }
+    if (libriscvm_get_reg(guest.vm, 10) != 7)
+    {
+        return "result not in a0";
+    }
+    if (libriscvm_run(guest.vm, 1000, 0) != LIBRISCVM_STATUS_EXITED || libriscvm_get_reg(guest.vm, 10) != 7)
+    {
+        return "guest did not continue after the system call";
+    }
+    return nullptr;
+}
+
+int main()
+{
+    if (libriscvm_api_version() != LIBRISCVM_API_VERSION)
+    {
+        puts("API version mismatch");
+        return EXIT_FAILURE;
+    }
+
+    struct
+    {
+        const char* name;
+        const char* (*run)();
+    } tests[] = {
+        {"exit", test_exit},
+        {"budget", test_budget},
+        {"fault", test_fault},
+        {"illegal", test_illegal},
+#if defined(SANDBOX_MEMORY) || defined(PAGED_MEMORY)
+        {"sandbox_host_call", test_sandbox_host_call},
+#endif // SANDBOX_MEMORY || PAGED_MEMORY
+        {"yield", test_yield},
+    };
+
+    auto total      = 0;
+    auto successful = 0;
+    for (const auto& test : tests)
+    {
+        printf("[%s] ", test.name);
+        total++;
+        auto error = test.run();
+        if (error != nullptr)
+        {
+            printf("FAILURE (%s)\n", error);
+        }
+        else
+        {
+            puts("SUCCESS");
+            successful++;
+        }
+    }
+
+    printf("\n%d/%d tests successful (%.2f%%)\n", successful, total, successful * 1.0f / total * 100);
+    return successful == total ? EXIT_SUCCESS : EXIT_FAILURE;
+}
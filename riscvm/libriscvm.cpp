@@ -0,0 +1,356 @@
+#include "libriscvm.h"
+
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+#include <unordered_map>
+
+#include "riscvm.h"
+
+#if !defined(INSTRUCTION_BUDGET) || !defined(SYSCALL_HOOK)
+#error "libriscvm requires INSTRUCTION_BUDGET and SYSCALL_HOOK"
+#endif // INSTRUCTION_BUDGET && SYSCALL_HOOK
+
+static_assert((int)LIBRISCVM_STATUS_RUNNING == (int)riscvm_status_running, "");
+static_assert((int)LIBRISCVM_STATUS_EXITED == (int)riscvm_status_exited, "");
+static_assert((int)LIBRISCVM_STATUS_BUDGET == (int)riscvm_status_budget, "");
+static_assert((int)LIBRISCVM_STATUS_FAULT == (int)riscvm_status_fault, "");
+static_assert((int)LIBRISCVM_STATUS_YIELD == (int)riscvm_status_yield, "");
+
+#ifndef PAGED_MEMORY
+#define LIBRISCVM_ALIGNMENT 0x1000
+#endif // PAGED_MEMORY
+
+struct libriscvm_syscall
+{
+    libriscvm_syscall_fn handler;
+    void*                userdata;
+};
+
+// Standard layout with the riscvm first, so the hooks can get back to the libriscvm_vm
+struct libriscvm_vm
+{
+    riscvm vm;
+
+    uint8_t* memory;
+    uint64_t memory_size;
+#ifdef OPCODE_SHUFFLING
+    riscvm_opcode_map opcode_map;
+#endif // OPCODE_SHUFFLING
+
+    std::unordered_map<uint64_t, libriscvm_syscall>* syscalls;
+    libriscvm_counters                               counters;
+};
+
+static void libriscvm_on_syscall(riscvm* self, uint64_t)
+{
+    ((libriscvm_vm*)self)->counters.syscalls++;
+}
+
+static bool libriscvm_unknown_syscall(riscvm* self, uint64_t code, uint64_t* result)
+{
+    auto vm  = (libriscvm_vm*)self;
+    auto itr = vm->syscalls->find(code);
+    if (itr == vm->syscalls->end())
+    {
+        self->status = riscvm_status_fault;
+        return false;
+    }
+    auto keep_running = itr->second.handler(vm, code, itr->second.userdata, result) != 0;
+    return keep_running && self->status == riscvm_status_running;
+}
+
+uint32_t libriscvm_api_version(void)
+{
+    return LIBRISCVM_API_VERSION;
+}
+
+libriscvm_vm* libriscvm_create(uint64_t memory_size)
+{
+    auto vm = (libriscvm_vm*)calloc(1, sizeof(libriscvm_vm));
+    if (vm == nullptr)
+    {
+        return nullptr;
+    }
+    vm->syscalls = new (std::nothrow) std::unordered_map<uint64_t, libriscvm_syscall>();
+    if (vm->syscalls == nullptr)
+    {
+        free(vm);
+        return nullptr;
+    }
+    vm->vm.on_syscall      = libriscvm_on_syscall;
+    vm->vm.unknown_syscall = libriscvm_unknown_syscall;
+
+#if defined(SANDBOX_MEMORY)
+    (void)memory_size;
+    vm->memory          = riscvm_sandbox_alloc();
+    vm->memory_size     = RISCVM_SANDBOX_SIZE;
+    vm->vm.memory       = vm->memory;
+    auto memory_failure = vm->memory == nullptr;
+#elif defined(PAGED_MEMORY)
+    // Pages are mapped when the image is loaded
+    (void)memory_size;
+    auto memory_failure = false;
+#else
+    memory_size         = (memory_size + LIBRISCVM_ALIGNMENT - 1) & ~(uint64_t)(LIBRISCVM_ALIGNMENT - 1);
+    vm->memory          = (uint8_t*)operator new(memory_size, std::align_val_t(LIBRISCVM_ALIGNMENT), std::nothrow);
+    vm->memory_size     = memory_size;
+    auto memory_failure = memory_size == 0 || vm->memory == nullptr;
+    if (!memory_failure)
+    {
+        memset(vm->memory, 0, memory_size);
+    }
+#endif // SANDBOX_MEMORY
+    if (memory_failure)
+    {
+        libriscvm_destroy(vm);
+        return nullptr;
+    }
+
+#ifdef OPCODE_SHUFFLING
+    riscvm_load_opcode_map(&vm->opcode_map, nullptr);
+    vm->vm.opcodes = &vm->opcode_map;
+#endif // OPCODE_SHUFFLING
+    return vm;
+}
+
+void libriscvm_destroy(libriscvm_vm* vm)
+{
+    if (vm == nullptr)
+    {
+        return;
+    }
+#if defined(SANDBOX_MEMORY)
+    riscvm_sandbox_free(vm->memory);
+#elif defined(PAGED_MEMORY)
+    riscvm_paged_free(&vm->vm);
+#else
+    if (vm->memory != nullptr)
+    {
+        operator delete(vm->memory, std::align_val_t(LIBRISCVM_ALIGNMENT));
+    }
+#endif // SANDBOX_MEMORY
+    delete vm->syscalls;
+    free(vm);
+}
+
+static libriscvm_error libriscvm_load_features(libriscvm_vm* vm, const uint8_t* image, uint64_t size)
+{
+#pragma pack(1)
+    struct Features
+    {
+        uint32_t magic;
+        struct
+        {
+            bool encrypted  : 1;
+            bool shuffled   : 1;
+            bool opcode_map : 1;
+        };
+        uint32_t key;
+    };
+#pragma pack()
+    static_assert(sizeof(Features) == 9, "");
+
+    Features features = {};
+    if (size >= sizeof(Features))
+    {
+        memcpy(&features, image + size - sizeof(Features), sizeof(Features));
+    }
+    if (features.magic != RISCVM_IMAGE_FEATURES_MAGIC)
+    {
+#ifdef CODE_ENCRYPTION
+        return LIBRISCVM_ERROR_FEATURES;
+#endif // CODE_ENCRYPTION
+        features = {};
+    }
+
+#ifdef OPCODE_SHUFFLING
+    riscvm_load_opcode_map(&vm->opcode_map, nullptr);
+    if (features.shuffled)
+    {
+        if (!features.opcode_map || size < sizeof(Features) + sizeof(riscvm_encoded_map))
+        {
+            return LIBRISCVM_ERROR_FEATURES;
+        }
+        auto encoded = (const riscvm_encoded_map*)(image + size - sizeof(Features) - sizeof(riscvm_encoded_map));
+        riscvm_load_opcode_map(&vm->opcode_map, encoded);
+    }
+#else
+    if (features.shuffled)
+    {
+        return LIBRISCVM_ERROR_FEATURES;
+    }
+#endif // OPCODE_SHUFFLING
+
+#ifdef CODE_ENCRYPTION
+    if (!features.encrypted)
+    {
+        return LIBRISCVM_ERROR_FEATURES;
+    }
+    vm->vm.base = vm->vm.pc;
+    vm->vm.key  = features.key;
+#else
+    (void)vm;
+    if (features.encrypted)
+    {
+        return LIBRISCVM_ERROR_FEATURES;
+    }
+#endif // CODE_ENCRYPTION
+    return LIBRISCVM_OK;
+}
+
+libriscvm_error libriscvm_load(libriscvm_vm* vm, const void* image, uint64_t size)
+{
+    if (vm == nullptr || (image == nullptr && size > 0))
+    {
+        return LIBRISCVM_ERROR_ARGUMENT;
+    }
+
+    auto self = &vm->vm;
+    memset(self->regs, 0, sizeof(self->regs));
+    reg_write(reg_a0, RISCVM_HOST_FEATURES);
+    self->status = riscvm_status_running;
+    vm->counters = {};
+
+#if defined(SANDBOX_MEMORY)
+    if (size > RISCVM_SANDBOX_SIZE / 2)
+    {
+        return LIBRISCVM_ERROR_TOO_BIG;
+    }
+    memcpy(vm->memory + RISCVM_SANDBOX_CODE, image, size);
+    reg_write(reg_sp, RISCVM_SANDBOX_STACK_TOP - 0x10);
+    self->pc = (int64_t)RISCVM_SANDBOX_CODE;
+#elif defined(PAGED_MEMORY)
+    if (size > RISCVM_PAGED_SIZE / 2)
+    {
+        return LIBRISCVM_ERROR_TOO_BIG;
+    }
+    riscvm_paged_free(self);
+    auto data_start = (RISCVM_PAGED_CODE + size + RISCVM_PAGE_OFFSET) & ~RISCVM_PAGE_OFFSET;
+    if (!riscvm_paged_map(self, RISCVM_PAGED_CODE, size, riscvm_page_read | riscvm_page_write | riscvm_page_exec) ||
+        !riscvm_paged_map(self, data_start, RISCVM_PAGED_STACK_TOP - data_start, riscvm_page_read | riscvm_page_write) ||
+        !riscvm_paged_copy(self, RISCVM_PAGED_CODE, image, size))
+    {
+        riscvm_paged_free(self);
+        return LIBRISCVM_ERROR_MEMORY;
+    }
+    reg_write(reg_sp, RISCVM_PAGED_STACK_TOP - 0x10);
+    self->pc = (int64_t)RISCVM_PAGED_CODE;
+#else
+    // Leave at least a page for the stack
+    if (size > vm->memory_size - LIBRISCVM_ALIGNMENT)
+    {
+        return LIBRISCVM_ERROR_TOO_BIG;
+    }
+    memcpy(vm->memory, image, size);
+    reg_write(reg_sp, (uint64_t)(vm->memory + vm->memory_size - 0x10));
+    self->pc = (int64_t)vm->memory;
+#endif // SANDBOX_MEMORY
+
+    return libriscvm_load_features(vm, (const uint8_t*)image, size);
+}
+
+libriscvm_status libriscvm_run(libriscvm_vm* vm, int64_t budget, uint64_t timeout_us)
+{
+    auto self   = &vm->vm;
+    auto status = riscvm_resume(self, budget, timeout_us);
+    vm->counters.instructions += budget - (self->budget < 0 ? 0 : self->budget);
+    vm->counters.runs++;
+    return (libriscvm_status)status;
+}
+
+libriscvm_error libriscvm_register_syscall(libriscvm_vm* vm, uint64_t code, libriscvm_syscall_fn handler, void* userdata)
+{
+    if (vm == nullptr || handler == nullptr)
+    {
+        return LIBRISCVM_ERROR_ARGUMENT;
+    }
+    if (!vm->syscalls->emplace(code, libriscvm_syscall{handler, userdata}).second)
+    {
+        return LIBRISCVM_ERROR_SYSCALL_IN_USE;
+    }
+    return LIBRISCVM_OK;
+}
+
+void libriscvm_yield(libriscvm_vm* vm)
+{
+    vm->vm.status = riscvm_status_yield;
+}
+
+uint64_t libriscvm_get_reg(libriscvm_vm* vm, uint32_t index)
+{
+    return index < 32 ? vm->vm.regs[index] : 0;
+}
+
+void libriscvm_set_reg(libriscvm_vm* vm, uint32_t index, uint64_t value)
+{
+    // x0 is hardwired to zero
+    if (index > 0 && index < 32)
+    {
+        vm->vm.regs[index] = value;
+    }
+}
+
+uint64_t libriscvm_get_pc(libriscvm_vm* vm)
+{
+    return (uint64_t)vm->vm.pc;
+}
+
+// Host pointer for [addr, addr + size) of the guest, nullptr if any of it is outside the guest memory
+static uint8_t* libriscvm_translate(libriscvm_vm* vm, uint64_t addr, uint64_t size)
+{
+#if defined(SANDBOX_MEMORY)
+    if (addr < RISCVM_SANDBOX_GUARD || addr > RISCVM_SANDBOX_SIZE || size > RISCVM_SANDBOX_SIZE - addr)
+    {
+        return nullptr;
+    }
+    return vm->memory + addr;
+#elif defined(PAGED_MEMORY)
+    (void)vm;
+    (void)addr;
+    (void)size;
+    return nullptr;
+#else
+    auto offset = addr - (uint64_t)vm->memory;
+    if (addr < (uint64_t)vm->memory || offset > vm->memory_size || size > vm->memory_size - offset)
+    {
+        return nullptr;
+    }
+    return vm->memory + offset;
+#endif // SANDBOX_MEMORY
+}
+
+libriscvm_error libriscvm_read(libriscvm_vm* vm, uint64_t addr, void* data, uint64_t size)
+{
+#ifdef PAGED_MEMORY
+    return riscvm_paged_read(&vm->vm, addr, data, size) ? LIBRISCVM_OK : LIBRISCVM_ERROR_ARGUMENT;
+#else
+    auto memory = libriscvm_translate(vm, addr, size);
+    if (memory == nullptr)
+    {
+        return LIBRISCVM_ERROR_ARGUMENT;
+    }
+    memcpy(data, memory, size);
+    return LIBRISCVM_OK;
+#endif // PAGED_MEMORY
+}
+
+libriscvm_error libriscvm_write(libriscvm_vm* vm, uint64_t addr, const void* data, uint64_t size)
+{
+#ifdef PAGED_MEMORY
+    return riscvm_paged_copy(&vm->vm, addr, data, size) ? LIBRISCVM_OK : LIBRISCVM_ERROR_ARGUMENT;
+#else
+    auto memory = libriscvm_translate(vm, addr, size);
+    if (memory == nullptr)
+    {
+        return LIBRISCVM_ERROR_ARGUMENT;
+    }
+    memcpy(memory, data, size);
+    return LIBRISCVM_OK;
+#endif // PAGED_MEMORY
+}
+
+void libriscvm_get_counters(libriscvm_vm* vm, libriscvm_counters* counters)
+{
+    *counters = vm->counters;
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+/*
+ * Stable C API to embed riscvm. Everything here stays source and binary
+ * compatible within an API version, no matter which options (dispatch,
+ * memory model, encryption) the library itself was built with.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32) && defined(LIBRISCVM_SHARED)
+#ifdef LIBRISCVM_BUILD
+#define LIBRISCVM_API __declspec(dllexport)
+#else
+#define LIBRISCVM_API __declspec(dllimport)
+#endif // LIBRISCVM_BUILD
+#elif defined(__GNUC__)
+#define LIBRISCVM_API __attribute__((visibility("default")))
+#else
+#define LIBRISCVM_API
+#endif // _WIN32 && LIBRISCVM_SHARED
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif // __cplusplus
+
+// Bumped on every incompatible change to this header
+#define LIBRISCVM_API_VERSION 1
+
+typedef struct libriscvm_vm libriscvm_vm;
+
+typedef enum libriscvm_status
+{
+    LIBRISCVM_STATUS_RUNNING,
+    LIBRISCVM_STATUS_EXITED, // exit system call or ebreak, the exit code is in a0
+    LIBRISCVM_STATUS_BUDGET, // out of instructions or past the timeout, resumable
+    LIBRISCVM_STATUS_FAULT,  // illegal instruction, illegal system call or page fault
+    LIBRISCVM_STATUS_YIELD,  // a system call handler called libriscvm_yield, resumable
+} libriscvm_status;
+
+typedef enum libriscvm_error
+{
+    LIBRISCVM_OK                   = 0,
+    LIBRISCVM_ERROR_ARGUMENT       = -1,
+    LIBRISCVM_ERROR_MEMORY         = -2, // the guest memory could not be allocated
+    LIBRISCVM_ERROR_TOO_BIG        = -3, // the image does not fit the guest memory
+    LIBRISCVM_ERROR_FEATURES       = -4, // the image was built for other encryption/shuffling options
+    LIBRISCVM_ERROR_SYSCALL_IN_USE = -5,
+} libriscvm_error;
+
+/*
+ * Handles a system call that riscvm does not implement itself. The arguments
+ * are in a0-a6 (see libriscvm_get_reg), the value stored to result ends up
+ * in a0. Returning 0 stops the guest with LIBRISCVM_STATUS_EXITED, unless the
+ * handler called libriscvm_yield.
+ */
+typedef int (*libriscvm_syscall_fn)(libriscvm_vm* vm, uint64_t code, void* userdata, uint64_t* result);
+
+typedef struct libriscvm_counters
+{
+    uint64_t instructions; // retired by libriscvm_run
+    uint64_t syscalls;
+    uint64_t runs;
+} libriscvm_counters;
+
+// LIBRISCVM_API_VERSION of the library, to check against the header at runtime
+LIBRISCVM_API uint32_t libriscvm_api_version(void);
+
+/*
+ * memory_size is the guest memory for the image, its data and the stack.
+ * Builds with a sandboxed or paged memory model have a fixed guest address
+ * space and ignore it. Returns NULL when the memory cannot be allocated.
+ */
+LIBRISCVM_API libriscvm_vm* libriscvm_create(uint64_t memory_size);
+LIBRISCVM_API void          libriscvm_destroy(libriscvm_vm* vm);
+
+/*
+ * Copies a flat image (as produced by the payload build, including the
+ * optional features trailer) to the start of the guest memory and points pc
+ * at its first instruction and sp at the end of the memory. Loading again
+ * resets the registers and the counters, but not the rest of the memory.
+ */
+LIBRISCVM_API libriscvm_error libriscvm_load(libriscvm_vm* vm, const void* image, uint64_t size);
+
+/*
+ * Runs at most budget instructions, and when timeout_us is not zero stops
+ * shortly after the timeout. Call it again after LIBRISCVM_STATUS_BUDGET or
+ * LIBRISCVM_STATUS_YIELD to continue.
+ */
+LIBRISCVM_API libriscvm_status libriscvm_run(libriscvm_vm* vm, int64_t budget, uint64_t timeout_us);
+
+/*
+ * Adds a system call to the ones riscvm implements itself, which always take
+ * precedence. Fails with LIBRISCVM_ERROR_SYSCALL_IN_USE if code already has
+ * a handler. Unhandled system calls fault the guest.
+ */
+LIBRISCVM_API libriscvm_error
+libriscvm_register_syscall(libriscvm_vm* vm, uint64_t code, libriscvm_syscall_fn handler, void* userdata);
+
+/*
+ * Only valid in a system call handler: once it returns, libriscvm_run returns
+ * LIBRISCVM_STATUS_YIELD with the result already in a0, and the next call to
+ * libriscvm_run continues after the system call.
+ */
+LIBRISCVM_API void libriscvm_yield(libriscvm_vm* vm);
+
+LIBRISCVM_API uint64_t libriscvm_get_reg(libriscvm_vm* vm, uint32_t index);
+LIBRISCVM_API void     libriscvm_set_reg(libriscvm_vm* vm, uint32_t index, uint64_t value);
+LIBRISCVM_API uint64_t libriscvm_get_pc(libriscvm_vm* vm);
+
+// Access guest memory by guest address, for system call handlers that take pointers
+LIBRISCVM_API libriscvm_error libriscvm_read(libriscvm_vm* vm, uint64_t addr, void* data, uint64_t size);
+LIBRISCVM_API libriscvm_error libriscvm_write(libriscvm_vm* vm, uint64_t addr, const void* data, uint64_t size);
+
+LIBRISCVM_API void libriscvm_get_counters(libriscvm_vm* vm, libriscvm_counters* counters);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
@@ -15,15 +15,49 @@ void riscvm_loadfile(riscvm_ptr self, const char* filename)
     fseek(fp, 0, SEEK_END);
     long size = ftell(fp);
     fseek(fp, 0, SEEK_SET);
+#ifdef SANDBOX_MEMORY
+    self->memory = riscvm_sandbox_alloc();
+    if (self->memory == nullptr)
+    {
+        log("failed to allocate sandbox\n");
+        exit(EXIT_FAILURE);
+    }
+    uint8_t* code = self->memory + RISCVM_SANDBOX_CODE;
+    if (size > RISCVM_SANDBOX_SIZE / 2)
+#elif defined(PAGED_MEMORY)
+    // Read into a host buffer first, the guest pages are filled below
+    uint8_t* code = (uint8_t*)malloc(size);
+    if (code == nullptr || size > RISCVM_PAGED_SIZE / 2)
+#else
+    uint8_t* code = g_code;
     if (size > sizeof(g_code))
+#endif // SANDBOX_MEMORY
     {
         log("loaded code too big!\n");
         exit(EXIT_FAILURE);
     }
-    fread(g_code, size, 1, fp);
+    fread(code, size, 1, fp);
     fclose(fp);
+    reg_write(reg_a0, RISCVM_HOST_FEATURES);
+#if defined(SANDBOX_MEMORY)
+    reg_write(reg_sp, RISCVM_SANDBOX_STACK_TOP - 0x10);
+    self->pc = (int64_t)RISCVM_SANDBOX_CODE;
+#elif defined(PAGED_MEMORY)
+    // Everything past the image is reserved as demand-zero heap and stack
+    auto data_start = (RISCVM_PAGED_CODE + size + RISCVM_PAGE_OFFSET) & ~RISCVM_PAGE_OFFSET;
+    if (!riscvm_paged_map(self, RISCVM_PAGED_CODE, size, riscvm_page_read | riscvm_page_write | riscvm_page_exec) ||
+        !riscvm_paged_map(self, data_start, RISCVM_PAGED_STACK_TOP - data_start, riscvm_page_read | riscvm_page_write) ||
+        !riscvm_paged_copy(self, RISCVM_PAGED_CODE, code, size))
+    {
+        log("failed to map guest memory\n");
+        exit(EXIT_FAILURE);
+    }
+    reg_write(reg_sp, RISCVM_PAGED_STACK_TOP - 0x10);
+    self->pc = (int64_t)RISCVM_PAGED_CODE;
+#else
     reg_write(reg_sp, (uint64_t)&g_stack[sizeof(g_stack) - 0x10]);
     self->pc = (int64_t)g_code;
+#endif // SANDBOX_MEMORY
 
 #pragma pack(1)
     struct Features
@@ -31,29 +65,41 @@ void riscvm_loadfile(riscvm_ptr self, const char* filename)
         uint32_t magic;
         struct
         {
-            bool encrypted : 1;
-            bool shuffled  : 1;
+            bool encrypted  : 1;
+            bool shuffled   : 1;
+            bool opcode_map : 1;
         };
         uint32_t key;
     };
     static_assert(sizeof(Features) == 9, "");
 
-    auto features = (Features*)(g_code + size - sizeof(Features));
-    if (features->magic != 'TAEF')
+#ifdef OPCODE_SHUFFLING
+    static riscvm_opcode_map opcode_map;
+    riscvm_load_opcode_map(&opcode_map, nullptr);
+    self->opcodes = &opcode_map;
+#endif // OPCODE_SHUFFLING
+
+    auto features = (Features*)(code + size - sizeof(Features));
+    if ((size_t)size < sizeof(Features) || features->magic != RISCVM_IMAGE_FEATURES_MAGIC)
     {
         log("no features in the file (unencrypted payload?)\n");
-#if defined(CODE_ENCRYPTION) || defined(OPCODE_SHUFFLING)
+#if defined(CODE_ENCRYPTION)
         exit(EXIT_FAILURE);
 #else
         return;
-#endif // CODE_ENCRYPTION || OPCODE_SHUFFLING
+#endif // CODE_ENCRYPTION
     }
 
 #ifdef OPCODE_SHUFFLING
-    if (!features->shuffled)
+    if (features->shuffled)
     {
-        log("shuffling enabled on the host, disabled in the bytecode");
-        exit(EXIT_FAILURE);
+        if (!features->opcode_map || (size_t)size < sizeof(Features) + sizeof(riscvm_encoded_map))
+        {
+            log("no opcode map in the shuffled bytecode");
+            exit(EXIT_FAILURE);
+        }
+        auto encoded = (const riscvm_encoded_map*)((uint8_t*)features - sizeof(riscvm_encoded_map));
+        riscvm_load_opcode_map(&opcode_map, encoded);
     }
 #else
     if (features->shuffled)
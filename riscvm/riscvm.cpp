@@ -1,4 +1,5 @@
 #include <array>
+#include <chrono>
 
 #include <string.h>
 #include <stdbool.h>
@@ -16,6 +17,21 @@
 #endif // _WIN32
 #endif // DEBUG_SYSCALLS
 
+#ifdef SANDBOX_MEMORY
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif // _WIN32
+#endif // SANDBOX_MEMORY
+
+#if defined(_WIN32) && !defined(SANDBOX_MEMORY) && !defined(PAGED_MEMORY)
+#include <windows.h>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#endif // _WIN32 && !SANDBOX_MEMORY && !PAGED_MEMORY
+
 #if defined(_MSC_VER)
 #include <intrin.h>
 #elif defined(__clang__)
@@ -31,6 +47,10 @@
 #include "riscvm.h"
 #include "trace.h"
 
+#if defined(_WIN32) && !defined(SANDBOX_MEMORY) && !defined(PAGED_MEMORY)
+#include "lib/exports.h"
+#endif // _WIN32 && !SANDBOX_MEMORY && !PAGED_MEMORY
+
 bool g_trace;
 
 #ifdef CODE_ENCRYPTION
@@ -64,21 +84,624 @@ ALWAYS_INLINE static uint32_t transform(uintptr_t offset, uint32_t key)
 }
 #endif // CODE_ENCRYPTION
 
-ALWAYS_INLINE static uint32_t riscvm_fetch(riscvm_ptr self)
+#ifdef OPCODE_SHUFFLING
+// funct3 | (funct7 & 0b11) << 3, the shuffled (funct7 << 3) | funct3 of op64/op32 always fits
+ALWAYS_INLINE static uint32_t riscvm_funct_index(uint32_t bits)
+{
+    return ((bits >> 12) & 0b111) | ((bits >> 22) & 0b11000);
+}
+
+ALWAYS_INLINE static uint32_t riscvm_unshuffle(riscvm_ptr self, uint32_t bits)
+{
+    auto     map    = self->opcodes;
+    uint32_t opcode = (bits >> 2) & 0b11111;
+    uint32_t funct  = riscvm_funct_index(bits) & map->funct[opcode];
+    return (bits & map->keep[opcode]) | map->remap[opcode][funct];
+}
+
+void riscvm_load_opcode_map(riscvm_opcode_map* map, const riscvm_encoded_map* encoded)
+{
+    // The identity map keeps every instruction bit
+    memset(map, 0, sizeof(riscvm_opcode_map));
+    for (uint32_t i = 0; i < 32; i++)
+    {
+        map->keep[i] = ~0u;
+    }
+
+    if (encoded == nullptr)
+    {
+        return;
+    }
+
+    for (uint32_t i = 0; i < 32; i++)
+    {
+        uint32_t opcode = encoded->opcodes[i] < 32 ? encoded->opcodes[i] : 0b11111;
+
+        map->keep[i]     = ~(0b11111u << 2);
+        map->remap[i][0] = opcode << 2;
+
+        const uint8_t*  funct3  = nullptr;
+        const uint16_t* funct10 = nullptr;
+        switch (opcode)
+        {
+        case rv64_load:
+            funct3 = encoded->load;
+            break;
+        case rv64_store:
+            funct3 = encoded->store;
+            break;
+        case rv64_imm64:
+            funct3 = encoded->imm64;
+            break;
+        case rv64_imm32:
+            funct3 = encoded->imm32;
+            break;
+        case rv64_branch:
+            funct3 = encoded->branch;
+            break;
+        case rv64_op64:
+            funct10 = encoded->op64;
+            break;
+        case rv64_op32:
+            funct10 = encoded->op32;
+            break;
+        default:
+            break;
+        }
+
+        if (funct3 != nullptr)
+        {
+            map->keep[i] &= ~(0b111u << 12);
+            map->funct[i] = 0b111;
+
+            // Unused shuffled values get the unused original values, so illegal instructions stay illegal
+            bool used[8] = {};
+            for (uint32_t j = 0; j < 8; j++)
+            {
+                if (funct3[j] < 8)
+                {
+                    used[funct3[j]] = true;
+                }
+            }
+
+            uint32_t unused = 0;
+            for (uint32_t j = 0; j < 8; j++)
+            {
+                uint32_t value = funct3[j];
+                if (value >= 8)
+                {
+                    while (used[unused])
+                    {
+                        unused++;
+                    }
+                    used[unused] = true;
+                    value        = unused;
+                }
+                map->remap[i][j] = (opcode << 2) | (value << 12);
+            }
+        }
+        else if (funct10 != nullptr)
+        {
+            map->keep[i] &= ~((0b111u << 12) | (0b1111111u << 25));
+            map->funct[i] = 0b11111;
+
+            for (uint32_t j = 0; j < 32; j++)
+            {
+                // funct7 = 0b1111111 is not a valid op/op-32 instruction
+                uint32_t value   = funct10[j] <= 0x3FF ? funct10[j] : 0x3F8;
+                map->remap[i][j] = (opcode << 2) | ((value & 0b111) << 12) | ((value >> 3) << 25);
+            }
+        }
+    }
+}
+#endif // OPCODE_SHUFFLING
+
+ALWAYS_INLINE static uint32_t riscvm_fetch(riscvm_ptr self, int64_t pc)
 {
+#ifdef PAGED_MEMORY
+    uint32_t data = riscvm_load<uint32_t>(self, pc, riscvm_access_exec);
+#elif defined(SANDBOX_MEMORY)
     uint32_t data;
-    memcpy(&data, (const void*)self->pc, sizeof(data));
+    memcpy(&data, riscvm_sandbox_access<uint32_t>(self, pc, true), sizeof(data));
+#else
+    uint32_t data = riscvm_read<uint32_t>(self, pc);
+#endif // PAGED_MEMORY
 
 #ifdef CODE_ENCRYPTION
-    return data ^ transform(self->pc - self->base, self->key);
-#else
-    return data;
+    data ^= transform(pc - self->base, self->key);
 #endif // CODE_ENCRYPTION
+
+#ifdef OPCODE_SHUFFLING
+    data = riscvm_unshuffle(self, data);
+#endif // OPCODE_SHUFFLING
+
+    return data;
+}
+
+#if defined(SANDBOX_MEMORY) || defined(PAGED_MEMORY)
+// Memory faults longjmp back to riscvm_run, which returns to the host
+#define riscvm_catch_faults()  \
+    jmp_buf fault;             \
+    self->fault = &fault;      \
+    if (setjmp(fault) != 0)    \
+    {                          \
+        self->fault = nullptr; \
+        return;                \
+    }
+#else
+#define riscvm_catch_faults()
+#endif // SANDBOX_MEMORY || PAGED_MEMORY
+
+#ifdef SANDBOX_MEMORY
+void riscvm_sandbox_fault(riscvm_ptr self, uint64_t addr, bool fetch)
+{
+    log("sandbox fault at 0x%" PRIx64 "\n", addr);
+    // DIRECT_DISPATCH has not spilled the pc it was about to fetch from yet
+    if (fetch)
+    {
+        self->pc = addr;
+    }
+    reg_write(reg_a0, -1);
+    self->status = riscvm_status_fault;
+    if (self->fault == nullptr)
+    {
+        abort();
+    }
+    longjmp(*self->fault, 1);
+}
+
+uint8_t* riscvm_sandbox_alloc()
+{
+    // Reserve the region plus a trailing guard, then commit everything past the null guard
+    size_t reserve = RISCVM_SANDBOX_SIZE + RISCVM_SANDBOX_GUARD;
+    size_t commit  = RISCVM_SANDBOX_SIZE - RISCVM_SANDBOX_GUARD;
+#if defined(_WIN32)
+    auto memory = (uint8_t*)VirtualAlloc(nullptr, reserve, MEM_RESERVE, PAGE_NOACCESS);
+    if (memory == nullptr)
+    {
+        return nullptr;
+    }
+    if (VirtualAlloc(memory + RISCVM_SANDBOX_GUARD, commit, MEM_COMMIT, PAGE_READWRITE) == nullptr)
+    {
+        VirtualFree(memory, 0, MEM_RELEASE);
+        return nullptr;
+    }
+#else
+    auto memory = (uint8_t*)mmap(nullptr, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    if (mprotect(memory + RISCVM_SANDBOX_GUARD, commit, PROT_READ | PROT_WRITE) != 0)
+    {
+        munmap(memory, reserve);
+        return nullptr;
+    }
+#endif // _WIN32
+    return memory;
+}
+
+bool riscvm_sandbox_reset(uint8_t* memory)
+{
+    // Replace the committed pages with fresh zero pages instead of clearing them by hand
+    size_t commit = RISCVM_SANDBOX_SIZE - RISCVM_SANDBOX_GUARD;
+#if defined(_WIN32)
+    if (!VirtualFree(memory + RISCVM_SANDBOX_GUARD, commit, MEM_DECOMMIT))
+    {
+        return false;
+    }
+    return VirtualAlloc(memory + RISCVM_SANDBOX_GUARD, commit, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+    auto flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED;
+    return mmap(memory + RISCVM_SANDBOX_GUARD, commit, PROT_READ | PROT_WRITE, flags, -1, 0) != MAP_FAILED;
+#endif // _WIN32
+}
+
+void riscvm_sandbox_free(uint8_t* memory)
+{
+    if (memory == nullptr)
+    {
+        return;
+    }
+#if defined(_WIN32)
+    VirtualFree(memory, 0, MEM_RELEASE);
+#else
+    munmap(memory, RISCVM_SANDBOX_SIZE + RISCVM_SANDBOX_GUARD);
+#endif // _WIN32
+}
+#endif // SANDBOX_MEMORY
+
+#ifdef PAGED_MEMORY
+#define RISCVM_TABLE_BITS  12
+#define RISCVM_TABLE_SIZE  (1ull << RISCVM_TABLE_BITS)
+#define RISCVM_TABLE_SHIFT (RISCVM_PAGE_BITS + RISCVM_TABLE_BITS)
+#define RISCVM_DIR_SIZE    (1ull << (RISCVM_PAGED_BITS - RISCVM_TABLE_SHIFT))
+static_assert(RISCVM_PAGED_BITS > RISCVM_TABLE_SHIFT, "RISCVM_PAGED_BITS too small");
+static_assert((RISCVM_TLB_SIZE & (RISCVM_TLB_SIZE - 1)) == 0, "RISCVM_TLB_SIZE must be a power of two");
+
+struct riscvm_page
+{
+    uint8_t* memory; // nullptr until the first access
+    uint32_t protection;
+};
+
+struct riscvm_page_table
+{
+    // Tables are allocated on demand, until then the whole range has the directory protection
+    riscvm_page* tables[RISCVM_DIR_SIZE];
+    uint32_t     protection[RISCVM_DIR_SIZE];
+};
+
+static riscvm_page* riscvm_paged_lookup(riscvm_page_table* pages, uint64_t addr)
+{
+    auto  dir   = addr >> RISCVM_TABLE_SHIFT;
+    auto& table = pages->tables[dir];
+    if (table == nullptr)
+    {
+        table = (riscvm_page*)calloc(RISCVM_TABLE_SIZE, sizeof(riscvm_page));
+        if (table == nullptr)
+        {
+            return nullptr;
+        }
+        for (uint64_t i = 0; i < RISCVM_TABLE_SIZE; i++)
+        {
+            table[i].protection = pages->protection[dir];
+        }
+    }
+    return &table[(addr >> RISCVM_PAGE_BITS) & (RISCVM_TABLE_SIZE - 1)];
+}
+
+static uint8_t* riscvm_paged_commit(riscvm_page* page)
+{
+    if (page->memory == nullptr)
+    {
+        page->memory = (uint8_t*)calloc(1, RISCVM_PAGE_SIZE);
+    }
+    return page->memory;
+}
+
+NEVER_INLINE static void riscvm_page_fault(riscvm_ptr self, uint64_t addr, riscvm_access access)
+{
+    log("page fault (access: %d) at 0x%" PRIx64 "\n", (int)access, addr);
+    reg_write(reg_a0, -1);
+    self->status = riscvm_status_fault;
+    if (self->fault == nullptr)
+    {
+        abort();
+    }
+    longjmp(*self->fault, 1);
+}
+
+void riscvm_paged_access(riscvm_ptr self, uint64_t addr, void* data, uint64_t size, riscvm_access access)
+{
+    // DIRECT_DISPATCH has not spilled the pc it is fetching from, a fault has to stop there
+    if (access == riscvm_access_exec)
+    {
+        self->pc = addr;
+    }
+
+    auto buffer = (uint8_t*)data;
+    while (size > 0)
+    {
+        auto pages = self->pages;
+        if (pages == nullptr || addr >= RISCVM_PAGED_SIZE)
+        {
+            riscvm_page_fault(self, addr, access);
+        }
+
+        // Check the directory protection first to avoid allocating tables for faults
+        auto     table      = pages->tables[addr >> RISCVM_TABLE_SHIFT];
+        uint32_t protection = table != nullptr ? table[(addr >> RISCVM_PAGE_BITS) & (RISCVM_TABLE_SIZE - 1)].protection
+                                               : pages->protection[addr >> RISCVM_TABLE_SHIFT];
+        if ((protection & (1 << access)) == 0)
+        {
+            riscvm_page_fault(self, addr, access);
+        }
+
+        auto page   = riscvm_paged_lookup(pages, addr);
+        auto memory = page != nullptr ? riscvm_paged_commit(page) : nullptr;
+        if (memory == nullptr)
+        {
+            riscvm_page_fault(self, addr, access);
+        }
+
+        auto  base  = addr & ~RISCVM_PAGE_OFFSET;
+        auto& entry = self->tlb[(addr >> RISCVM_PAGE_BITS) % RISCVM_TLB_SIZE];
+        for (int i = riscvm_access_read; i <= riscvm_access_exec; i++)
+        {
+            entry.tag[i] = (protection & (1 << i)) ? (base | RISCVM_PAGE_OFFSET) : 0;
+        }
+        entry.addend = (uintptr_t)memory - base;
+
+        // Accesses that straddle a page boundary are split
+        auto offset = addr & RISCVM_PAGE_OFFSET;
+        auto chunk  = size < RISCVM_PAGE_SIZE - offset ? size : RISCVM_PAGE_SIZE - offset;
+        if (access == riscvm_access_write)
+        {
+            memcpy(memory + offset, buffer, chunk);
+        }
+        else
+        {
+            memcpy(buffer, memory + offset, chunk);
+        }
+        addr += chunk;
+        buffer += chunk;
+        size -= chunk;
+    }
+}
+
+bool riscvm_paged_map(riscvm_ptr self, uint64_t addr, uint64_t size, uint32_t protection)
+{
+    if (addr >= RISCVM_PAGED_SIZE || size > RISCVM_PAGED_SIZE - addr)
+    {
+        return false;
+    }
+    if (self->pages == nullptr)
+    {
+        self->pages = (riscvm_page_table*)calloc(1, sizeof(riscvm_page_table));
+        if (self->pages == nullptr)
+        {
+            return false;
+        }
+    }
+
+    auto pages = self->pages;
+    auto end   = (addr + size + RISCVM_PAGE_OFFSET) & ~RISCVM_PAGE_OFFSET;
+    for (auto page = addr & ~RISCVM_PAGE_OFFSET; page < end;)
+    {
+        // Reserving whole directory entries does not allocate anything
+        auto dir       = page >> RISCVM_TABLE_SHIFT;
+        auto dir_start = dir << RISCVM_TABLE_SHIFT;
+        auto dir_end   = dir_start + (1ull << RISCVM_TABLE_SHIFT);
+        if (pages->tables[dir] == nullptr && page == dir_start && end >= dir_end)
+        {
+            pages->protection[dir] = protection;
+            page                   = dir_end;
+            continue;
+        }
+
+        auto entry = riscvm_paged_lookup(pages, page);
+        if (entry == nullptr)
+        {
+            return false;
+        }
+        entry->protection = protection;
+        page += RISCVM_PAGE_SIZE;
+    }
+
+    memset(self->tlb, 0, sizeof(self->tlb));
+    return true;
+}
+
+static bool riscvm_paged_transfer(riscvm_ptr self, uint64_t addr, uint8_t* buffer, uint64_t size, bool to_guest)
+{
+    if (self->pages == nullptr || addr >= RISCVM_PAGED_SIZE || size > RISCVM_PAGED_SIZE - addr)
+    {
+        return false;
+    }
+
+    while (size > 0)
+    {
+        auto page   = riscvm_paged_lookup(self->pages, addr);
+        auto memory = page != nullptr && page->protection != riscvm_page_none ? riscvm_paged_commit(page) : nullptr;
+        if (memory == nullptr)
+        {
+            return false;
+        }
+
+        auto offset = addr & RISCVM_PAGE_OFFSET;
+        auto chunk  = size < RISCVM_PAGE_SIZE - offset ? size : RISCVM_PAGE_SIZE - offset;
+        if (to_guest)
+        {
+            memcpy(memory + offset, buffer, chunk);
+        }
+        else
+        {
+            memcpy(buffer, memory + offset, chunk);
+        }
+        addr += chunk;
+        buffer += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+bool riscvm_paged_copy(riscvm_ptr self, uint64_t addr, const void* data, uint64_t size)
+{
+    return riscvm_paged_transfer(self, addr, (uint8_t*)data, size, true);
+}
+
+bool riscvm_paged_read(riscvm_ptr self, uint64_t addr, void* data, uint64_t size)
+{
+    return riscvm_paged_transfer(self, addr, (uint8_t*)data, size, false);
+}
+
+void riscvm_paged_free(riscvm_ptr self)
+{
+    auto pages = self->pages;
+    if (pages == nullptr)
+    {
+        return;
+    }
+    for (uint64_t dir = 0; dir < RISCVM_DIR_SIZE; dir++)
+    {
+        auto table = pages->tables[dir];
+        if (table == nullptr)
+        {
+            continue;
+        }
+        for (uint64_t i = 0; i < RISCVM_TABLE_SIZE; i++)
+        {
+            free(table[i].memory);
+        }
+        free(table);
+    }
+    free(pages);
+    self->pages = nullptr;
+    memset(self->tlb, 0, sizeof(self->tlb));
 }
+#endif // PAGED_MEMORY
 
 #ifdef CUSTOM_SYSCALLS
 #pragma message("Custom syscalls enabled")
 #else
+#ifdef PAGED_MEMORY
+// Guest memory is not contiguous on the host, these bounce through a page-sized buffer
+static void riscvm_paged_move(riscvm_ptr self, uint64_t dest, uint64_t src, uint64_t size)
+{
+    // Copy from the end when dest overlaps the tail of src
+    uint8_t buffer[RISCVM_PAGE_SIZE];
+    bool    backward = dest > src && dest - src < size;
+    while (size > 0)
+    {
+        auto chunk  = size < sizeof(buffer) ? size : sizeof(buffer);
+        auto offset = backward ? size - chunk : 0;
+        riscvm_paged_access(self, src + offset, buffer, chunk, riscvm_access_read);
+        riscvm_paged_access(self, dest + offset, buffer, chunk, riscvm_access_write);
+        if (!backward)
+        {
+            src += chunk;
+            dest += chunk;
+        }
+        size -= chunk;
+    }
+}
+
+static void riscvm_paged_set(riscvm_ptr self, uint64_t dest, int value, uint64_t size)
+{
+    uint8_t buffer[RISCVM_PAGE_SIZE];
+    memset(buffer, value, sizeof(buffer));
+    while (size > 0)
+    {
+        auto chunk = size < sizeof(buffer) ? size : sizeof(buffer);
+        riscvm_paged_access(self, dest, buffer, chunk, riscvm_access_write);
+        dest += chunk;
+        size -= chunk;
+    }
+}
+
+static int riscvm_paged_compare(riscvm_ptr self, uint64_t src1, uint64_t src2, uint64_t size)
+{
+    uint8_t buffer1[RISCVM_PAGE_SIZE];
+    uint8_t buffer2[RISCVM_PAGE_SIZE];
+    while (size > 0)
+    {
+        auto chunk = size < sizeof(buffer1) ? size : sizeof(buffer1);
+        riscvm_paged_access(self, src1, buffer1, chunk, riscvm_access_read);
+        riscvm_paged_access(self, src2, buffer2, chunk, riscvm_access_read);
+        if (auto result = memcmp(buffer1, buffer2, chunk))
+        {
+            return result;
+        }
+        src1 += chunk;
+        src2 += chunk;
+        size -= chunk;
+    }
+    return 0;
+}
+
+// Strings longer than the buffer are truncated. The buffer lives on the caller's stack so a page fault can
+// longjmp out of riscvm_read without leaking anything
+template <typename Char, size_t Size>
+static const Char* riscvm_paged_string(riscvm_ptr self, uint64_t addr, Char (&buffer)[Size])
+{
+    size_t i = 0;
+    for (; i < Size - 1; i++, addr += sizeof(Char))
+    {
+        if ((buffer[i] = riscvm_read<Char>(self, addr)) == 0)
+        {
+            return buffer;
+        }
+    }
+    buffer[i] = 0;
+    return buffer;
+}
+#else
+// Returns nullptr when [addr, addr + size) is not fully inside guest memory
+ALWAYS_INLINE static void* riscvm_getrange(riscvm_ptr self, uint64_t addr, uint64_t size)
+{
+#ifdef SANDBOX_MEMORY
+    if (addr < RISCVM_SANDBOX_GUARD || addr >= RISCVM_SANDBOX_SIZE || size > RISCVM_SANDBOX_SIZE - addr)
+    {
+        return nullptr;
+    }
+#else
+    (void)size;
+#endif // SANDBOX_MEMORY
+    return riscvm_getptr(self, addr);
+}
+
+// Upper bound for the length of a guest string at addr (in characters of size width)
+ALWAYS_INLINE static int riscvm_strlimit(riscvm_ptr self, uint64_t addr, size_t width)
+{
+    (void)self;
+#ifdef SANDBOX_MEMORY
+    return (int)((RISCVM_SANDBOX_SIZE - (addr & RISCVM_SANDBOX_MASK)) / width);
+#else
+    (void)addr;
+    (void)width;
+    return INT32_MAX;
+#endif // SANDBOX_MEMORY
+}
+#endif // PAGED_MEMORY
+
+#if defined(_WIN32) && !defined(SANDBOX_MEMORY) && !defined(PAGED_MEMORY)
+/*
+ * Resolved imports, shared by every guest for the lifetime of the process,
+ * so a payload that runs again skips the (interpreted) export lookups. The
+ * guest stores the addresses it resolved, but only after the host found the
+ * same address in the export table of the module, so one guest cannot make
+ * another call something else. Entries also remember which module they came
+ * from and miss once it got unloaded or another one was loaded at its base.
+ */
+#ifndef RISCVM_IMPORT_CACHE_MAX
+#define RISCVM_IMPORT_CACHE_MAX 65536
+#endif // RISCVM_IMPORT_CACHE_MAX
+
+struct riscvm_import_key
+{
+    uint64_t module_base;
+    uint32_t export_hash;
+
+    bool operator==(const riscvm_import_key& other) const
+    {
+        return module_base == other.module_base && export_hash == other.export_hash;
+    }
+};
+
+struct riscvm_import_key_hash
+{
+    size_t operator()(const riscvm_import_key& key) const
+    {
+        // Module bases are 64KB aligned, so their low bits are all export hash
+        return std::hash<uint64_t>()(key.module_base ^ key.export_hash);
+    }
+};
+
+struct riscvm_import_entry
+{
+    uint64_t address;
+    uint64_t module; // riscvm_module_identity when it was stored
+};
+
+static std::shared_mutex                                                                   g_import_cache_mutex;
+static std::unordered_map<riscvm_import_key, riscvm_import_entry, riscvm_import_key_hash> g_import_cache;
+
+// TimeDateStamp and SizeOfImage of the module loaded at image, 0 when no module is loaded there
+static uint64_t riscvm_module_identity(uint64_t image)
+{
+    HMODULE module = nullptr;
+    DWORD   flags  = GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT;
+    if (!GetModuleHandleExW(flags, (LPCWSTR)image, &module) || (uint64_t)module != image)
+    {
+        return 0;
+    }
+    auto dos = (const IMAGE_DOS_HEADER*)image;
+    auto nt  = (const IMAGE_NT_HEADERS*)(image + dos->e_lfanew);
+    return (uint64_t)nt->FileHeader.TimeDateStamp << 32 | nt->OptionalHeader.SizeOfImage;
+}
+#endif // _WIN32 && !SANDBOX_MEMORY && !PAGED_MEMORY
+
 ALWAYS_INLINE static bool riscvm_handle_syscall(riscvm_ptr self, uint64_t code, uint64_t& result)
 {
     switch (code)
@@ -95,59 +718,136 @@ ALWAYS_INLINE static bool riscvm_handle_syscall(riscvm_ptr self, uint64_t code,
         return false;
     }
 
+#ifdef PAGED_MEMORY
+    case 10006: // memcpy
+    case 10008: // memmove
+    {
+        riscvm_paged_move(self, reg_read(reg_a1), reg_read(reg_a0), reg_read(reg_a2));
+        result = reg_read(reg_a1);
+        break;
+    }
+
+    case 10007: // memset
+    {
+        riscvm_paged_set(self, reg_read(reg_a0), (int)reg_read(reg_a1), reg_read(reg_a2));
+        result = reg_read(reg_a0);
+        break;
+    }
+
+    case 10009: // memcmp
+    {
+        result = (uint64_t)riscvm_paged_compare(self, reg_read(reg_a0), reg_read(reg_a1), reg_read(reg_a2));
+        break;
+    }
+#else
     case 10006: // memcpy
     {
-        void* src  = riscvm_getptr(self, reg_read(reg_a0));
-        void* dest = riscvm_getptr(self, reg_read(reg_a1));
-        void* res  = memcpy(dest, src, (size_t)reg_read(reg_a2));
-        result     = (uint64_t)res;
+        auto  size = (size_t)reg_read(reg_a2);
+        void* src  = riscvm_getrange(self, reg_read(reg_a0), size);
+        void* dest = riscvm_getrange(self, reg_read(reg_a1), size);
+        if (src == nullptr || dest == nullptr)
+        {
+            log("memcpy out of bounds\n");
+            reg_write(reg_a0, -1);
+            self->status = riscvm_status_fault;
+            return false;
+        }
+        memcpy(dest, src, size);
+        result = reg_read(reg_a1);
         break;
     }
 
     case 10007: // memset
     {
-        void* dest = riscvm_getptr(self, reg_read(reg_a0));
-        void* res  = memset(dest, (int)reg_read(reg_a1), (size_t)reg_read(reg_a2));
-        result     = (uint64_t)res;
+        auto  size = (size_t)reg_read(reg_a2);
+        void* dest = riscvm_getrange(self, reg_read(reg_a0), size);
+        if (dest == nullptr)
+        {
+            log("memset out of bounds\n");
+            reg_write(reg_a0, -1);
+            self->status = riscvm_status_fault;
+            return false;
+        }
+        memset(dest, (int)reg_read(reg_a1), size);
+        result = reg_read(reg_a0);
         break;
     }
 
     case 10008: // memmove
     {
-        void* src  = riscvm_getptr(self, reg_read(reg_a0));
-        void* dest = riscvm_getptr(self, reg_read(reg_a1));
-        void* res  = memmove(dest, src, (size_t)reg_read(reg_a2));
-        result     = (uint64_t)res;
+        auto  size = (size_t)reg_read(reg_a2);
+        void* src  = riscvm_getrange(self, reg_read(reg_a0), size);
+        void* dest = riscvm_getrange(self, reg_read(reg_a1), size);
+        if (src == nullptr || dest == nullptr)
+        {
+            log("memmove out of bounds\n");
+            reg_write(reg_a0, -1);
+            self->status = riscvm_status_fault;
+            return false;
+        }
+        memmove(dest, src, size);
+        result = reg_read(reg_a1);
         break;
     }
 
     case 10009: // memcmp
     {
-        void* src1 = riscvm_getptr(self, reg_read(reg_a0));
-        void* src2 = riscvm_getptr(self, reg_read(reg_a1));
-        result     = (uint64_t)memcmp(src1, src2, (size_t)reg_read(reg_a2));
+        auto  size = (size_t)reg_read(reg_a2);
+        void* src1 = riscvm_getrange(self, reg_read(reg_a0), size);
+        void* src2 = riscvm_getrange(self, reg_read(reg_a1), size);
+        if (src1 == nullptr || src2 == nullptr)
+        {
+            log("memcmp out of bounds\n");
+            reg_write(reg_a0, -1);
+            self->status = riscvm_status_fault;
+            return false;
+        }
+        result = (uint64_t)memcmp(src1, src2, size);
+        break;
+    }
+#endif // PAGED_MEMORY
+
+#ifdef PAGED_MEMORY
+    case 10100: // print_wstring
+    {
+        if (reg_read(reg_a0) != 0)
+        {
+            wchar_t buffer[256];
+            wprintf(L"[syscall::wprint] %ls\n", riscvm_paged_string(self, reg_read(reg_a0), buffer));
+        }
         break;
     }
 
+    case 10101: // print_string
+    {
+        if (reg_read(reg_a0) != 0)
+        {
+            char buffer[256];
+            printf("[syscall::print] %s\n", riscvm_paged_string(self, reg_read(reg_a0), buffer));
+        }
+        break;
+    }
+#else
     case 10100: // print_wstring
     {
-        wchar_t* s = (wchar_t*)riscvm_getptr(self, reg_read(reg_a0));
+        wchar_t* s = (wchar_t*)riscvm_getrange(self, reg_read(reg_a0), sizeof(wchar_t));
         if (s != NULL)
         {
-            wprintf(L"[syscall::wprint] %ls\n", s);
+            wprintf(L"[syscall::wprint] %.*ls\n", riscvm_strlimit(self, reg_read(reg_a0), sizeof(wchar_t)), s);
         }
         break;
     }
 
     case 10101: // print_string
     {
-        char* s = (char*)riscvm_getptr(self, reg_read(reg_a0));
+        char* s = (char*)riscvm_getrange(self, reg_read(reg_a0), 1);
         if (s != NULL)
         {
-            printf("[syscall::print] %s\n", s);
+            printf("[syscall::print] %.*s\n", riscvm_strlimit(self, reg_read(reg_a0), 1), s);
         }
         break;
     }
+#endif // PAGED_MEMORY
 
     case 10102: // print_int
     {
@@ -163,12 +863,28 @@ ALWAYS_INLINE static bool riscvm_handle_syscall(riscvm_ptr self, uint64_t code,
 
     case 10104: // print_tag_hex
     {
-        printf("[syscall::print_tag_hex] %s: 0x%" PRIx64 "\n", (char*)reg_read(reg_a0), reg_read(reg_a1));
+#ifdef PAGED_MEMORY
+        char buffer[256];
+        printf("[syscall::print_tag_hex] %s: 0x%" PRIx64 "\n", riscvm_paged_string(self, reg_read(reg_a0), buffer),
+               reg_read(reg_a1));
+#else
+        auto tag = (char*)riscvm_getrange(self, reg_read(reg_a0), 1);
+        printf(
+            "[syscall::print_tag_hex] %.*s: 0x%" PRIx64 "\n",
+            tag != NULL ? riscvm_strlimit(self, reg_read(reg_a0), 1) : 0,
+            tag != NULL ? tag : "",
+            reg_read(reg_a1)
+        );
+#endif // PAGED_MEMORY
         break;
     }
 
     case 10105: // resolve_import
     {
+#if defined(SANDBOX_MEMORY) || defined(PAGED_MEMORY)
+        panic("resolve_import is not available in the sandbox");
+        return false;
+#else
         auto import_module = (const char*)reg_read(reg_a0);
         auto import_name   = (const char*)reg_read(reg_a1);
         printf("[syscall::resolve_import] %s:%s\n", import_module ? import_module : "<nullptr>", import_name);
@@ -200,6 +916,7 @@ ALWAYS_INLINE static bool riscvm_handle_syscall(riscvm_ptr self, uint64_t code,
 #endif // _WIN32
         printf("[syscall::resolve_import] result: %" PRIx64 "\n", result);
         break;
+#endif // SANDBOX_MEMORY || PAGED_MEMORY
     }
 
     case 0x5d: // linux exit
@@ -210,6 +927,10 @@ ALWAYS_INLINE static bool riscvm_handle_syscall(riscvm_ptr self, uint64_t code,
 
     case 20000: // host_call
     {
+#if defined(SANDBOX_MEMORY) || defined(PAGED_MEMORY)
+        panic("host_call is not available in the sandbox");
+        return false;
+#else
         uint64_t  func_addr = reg_read(reg_a0);
         uint64_t* args      = (uint64_t*)riscvm_getptr(self, reg_read(reg_a1));
 
@@ -232,12 +953,21 @@ ALWAYS_INLINE static bool riscvm_handle_syscall(riscvm_ptr self, uint64_t code,
                args[10],
                args[11],
                args[12]);
+        // The host function parked the guest (riscvm_status_yield) or stopped it
+        if (self->status != riscvm_status_running)
+        {
+            return false;
+        }
         break;
+#endif // SANDBOX_MEMORY || PAGED_MEMORY
     }
 
     case 20001: // get_peb
     {
-#ifdef _WIN32
+#if defined(SANDBOX_MEMORY) || defined(PAGED_MEMORY)
+        panic("get_peb is not available in the sandbox");
+        return false;
+#elif defined(_WIN32)
 #ifdef __clang__
         result = *(volatile uint64_t __attribute__((address_space(256)))*)0x60;
 #else
@@ -249,8 +979,92 @@ ALWAYS_INLINE static bool riscvm_handle_syscall(riscvm_ptr self, uint64_t code,
         break;
     }
 
+    case 20002: // import_cache_get
+    {
+#if defined(SANDBOX_MEMORY) || defined(PAGED_MEMORY)
+        panic("import_cache_get is not available in the sandbox");
+        return false;
+#elif defined(_WIN32)
+        riscvm_import_key key = {(uint64_t)reg_read(reg_a0), (uint32_t)reg_read(reg_a1)};
+        std::shared_lock  lock(g_import_cache_mutex);
+        auto              itr = g_import_cache.find(key);
+        result                = 0;
+        if (itr != g_import_cache.end() && itr->second.module == riscvm_module_identity(key.module_base))
+        {
+            result = itr->second.address;
+        }
+        break;
+#else
+        // Not advertised in RISCVM_HOST_FEATURES, always a miss
+        result = 0;
+        break;
+#endif // SANDBOX_MEMORY || PAGED_MEMORY
+    }
+
+    case 20003: // import_cache_set
+    {
+#if defined(SANDBOX_MEMORY) || defined(PAGED_MEMORY)
+        panic("import_cache_set is not available in the sandbox");
+        return false;
+#elif defined(_WIN32)
+        riscvm_import_key   key   = {(uint64_t)reg_read(reg_a0), (uint32_t)reg_read(reg_a1)};
+        riscvm_import_entry entry = {reg_read(reg_a2), riscvm_module_identity(key.module_base)};
+        if (entry.module == 0)
+        {
+            break;
+        }
+
+        // The native scan is cheap compared to the interpreted lookup the guest did
+        riscvm_exports exports;
+        riscvm_exports_init(&exports, (uintptr_t)key.module_base);
+        if (riscvm_exports_scan_hash(&exports, key.export_hash) != entry.address)
+        {
+            log("import_cache_set: 0x%" PRIx64 " is not export 0x%x\n", entry.address, key.export_hash);
+            break;
+        }
+
+        std::unique_lock lock(g_import_cache_mutex);
+        // Full means it only stops helping, nothing breaks
+        if (g_import_cache.size() < RISCVM_IMPORT_CACHE_MAX)
+        {
+            g_import_cache[key] = entry;
+        }
+        break;
+#else
+        break;
+#endif // SANDBOX_MEMORY || PAGED_MEMORY
+    }
+
+    case 20004: // host_call_regs
+    {
+#if defined(SANDBOX_MEMORY) || defined(PAGED_MEMORY)
+        panic("host_call is not available in the sandbox");
+        return false;
+#else
+        // Up to six arguments in a1-a6, the transpiler emits this for most import calls
+        using syscall_fn = uint64_t (*)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
+
+        syscall_fn fn = (syscall_fn)reg_read(reg_a0);
+        result        = fn(
+            reg_read(reg_a1), reg_read(reg_a2), reg_read(reg_a3), reg_read(reg_a4), reg_read(reg_a5), reg_read(reg_a6)
+        );
+        if (self->status != riscvm_status_running)
+        {
+            return false;
+        }
+        break;
+#endif // SANDBOX_MEMORY || PAGED_MEMORY
+    }
+
     default:
     {
+#ifdef SYSCALL_HOOK
+        if (self->unknown_syscall != nullptr)
+        {
+            return self->unknown_syscall(self, code, &result);
+        }
+#endif // SYSCALL_HOOK
+        self->status = riscvm_status_fault;
         panic("illegal system call %" PRIu64 " (0x%" PRIx64 ")\n", code, code);
         return false;
     }
@@ -275,10 +1089,38 @@ ALWAYS_INLINE static __int128 riscvm_shr_int128(__int128 a, __int128 b)
     }
 }
 
+#ifdef INSTRUCTION_BUDGET
+#pragma message("Instruction budget enabled")
+
+// Stops before the next instruction once the budget is used up, which leaves it at -1
+#define check_budget()                       \
+    if (UNLIKELY(self->budget-- <= 0))       \
+    {                                        \
+        spill_pc();                          \
+        self->status = riscvm_status_budget; \
+        return false;                        \
+    }
+#else
+#define check_budget()
+#endif // INSTRUCTION_BUDGET
+
 #ifdef DIRECT_DISPATCH
 #pragma message("Direct dispatch enabled")
+
+// The guest pc is passed along the musttail calls so it stays in a host register,
+// it is only written back to self->pc for system calls, tracing, faults and on exit.
+// The decoded instruction is passed by value, it fits in a register already. A pointer
+// into a predecoded copy of the code would go stale for self-modifying code and has to
+// keep CODE_ENCRYPTION/OPCODE_SHUFFLING plaintext around, so there is none. Guest
+// registers stay in self->regs because they are indexed by fields of the instruction.
+#define HANDLER_PARAMS riscvm_ptr self, Instruction inst, int64_t pc
+#define HANDLER_ARGS   self, inst, pc
+#define PC             pc
+#define spill_pc()     self->pc = pc
+#define reload_pc()    pc = self->pc
+
 #define HANDLER(op)   handler_##op
-#define FWHANDLER(op) static bool HANDLER(op)(riscvm_ptr self, Instruction inst)
+#define FWHANDLER(op) static bool HANDLER(op)(HANDLER_PARAMS)
 FWHANDLER(rv64_load);
 FWHANDLER(rv64_fence);
 FWHANDLER(rv64_imm64);
@@ -295,7 +1137,7 @@ FWHANDLER(rv64_system);
 FWHANDLER(rv64_invalid);
 #undef FWHANDLER
 
-typedef bool (*riscvm_handler_t)(riscvm_ptr, Instruction);
+typedef bool (*riscvm_handler_t)(riscvm_ptr, Instruction, int64_t);
 
 static constexpr std::array<riscvm_handler_t, 32> riscvm_handlers = []
 {
@@ -324,69 +1166,108 @@ static constexpr std::array<riscvm_handler_t, 32> riscvm_handlers = []
 
 #ifdef TRACING
 #define dispatch()                                       \
+    check_budget();                                      \
     Instruction next;                                    \
-    next.bits = riscvm_fetch(self);                      \
+    next.bits = riscvm_fetch(self, pc);                  \
     if (next.compressed_flags != 0b11)                   \
     {                                                    \
         panic("compressed instructions not supported!"); \
     }                                                    \
     if (g_trace)                                         \
+    {                                                    \
+        spill_pc();                                      \
         riscvm_trace(self, next);                        \
-    __attribute__((musttail)) return riscvm_handlers[next.opcode](self, next)
+    }                                                    \
+    __attribute__((musttail)) return riscvm_handlers[next.opcode](self, next, pc)
 #else
 #define dispatch()                                       \
+    check_budget();                                      \
     Instruction next;                                    \
-    next.bits = riscvm_fetch(self);                      \
+    next.bits = riscvm_fetch(self, pc);                  \
     if (next.compressed_flags != 0b11)                   \
     {                                                    \
         panic("compressed instructions not supported!"); \
     }                                                    \
-    __attribute__((musttail)) return riscvm_handlers[next.opcode](self, next)
+    __attribute__((musttail)) return riscvm_handlers[next.opcode](self, next, pc)
 #endif // TRACING
 
 #else
+#define HANDLER_PARAMS riscvm_ptr self, Instruction inst
+#define HANDLER_ARGS   self, inst
+#define PC             self->pc
+#define spill_pc()
+#define reload_pc()
+
 #define dispatch() return true
 #endif // DIRECT_DISPATCH
 
-ALWAYS_INLINE static bool handler_rv64_load(riscvm_ptr self, Instruction inst)
+#if defined(SANDBOX_MEMORY) || defined(PAGED_MEMORY)
+// Loads and stores can fault out of the handler, the host expects self->pc at the instruction
+#define spill_pc_for_fault() spill_pc()
+
+// Same as the panic in riscvm.h, the handlers below also have to leave self->pc at the instruction
+#undef panic
+#define panic(...)                          \
+    do                                      \
+    {                                       \
+        spill_pc();                         \
+        log(__VA_ARGS__);                   \
+        self->status = riscvm_status_fault; \
+        return false;                       \
+    } while (0)
+#else
+#define spill_pc_for_fault()
+#endif // SANDBOX_MEMORY || PAGED_MEMORY
+
+#ifdef THREADED_DISPATCH
+#pragma message("Threaded dispatch enabled")
+#if defined(DIRECT_DISPATCH)
+#error "THREADED_DISPATCH and DIRECT_DISPATCH are mutually exclusive"
+#elif !defined(__GNUC__) && !defined(__clang__)
+#error "THREADED_DISPATCH requires labels as values (GCC/Clang)"
+#endif
+#endif // THREADED_DISPATCH
+
+ALWAYS_INLINE static bool handler_rv64_load(HANDLER_PARAMS)
 {
     uint64_t addr = reg_read(inst.itype.rs1) + bit_signer(inst.itype.imm, 12);
     int64_t  val  = 0;
+    spill_pc_for_fault();
     switch (inst.itype.funct3)
     {
     case rv64_load_lb:
     {
-        val = riscvm_read<int8_t>(addr);
+        val = riscvm_read<int8_t>(self, addr);
         break;
     }
     case rv64_load_lh:
     {
-        val = riscvm_read<int16_t>(addr);
+        val = riscvm_read<int16_t>(self, addr);
         break;
     }
     case rv64_load_lw:
     {
-        val = riscvm_read<int32_t>(addr);
+        val = riscvm_read<int32_t>(self, addr);
         break;
     }
     case rv64_load_ld:
     {
-        val = riscvm_read<int64_t>(addr);
+        val = riscvm_read<int64_t>(self, addr);
         break;
     }
     case rv64_load_lbu:
     {
-        val = riscvm_read<uint8_t>(addr);
+        val = riscvm_read<uint8_t>(self, addr);
         break;
     }
     case rv64_load_lhu:
     {
-        val = riscvm_read<uint16_t>(addr);
+        val = riscvm_read<uint16_t>(self, addr);
         break;
     }
     case rv64_load_lwu:
     {
-        val = riscvm_read<uint32_t>(addr);
+        val = riscvm_read<uint32_t>(self, addr);
         break;
     }
     default:
@@ -398,35 +1279,36 @@ ALWAYS_INLINE static bool handler_rv64_load(riscvm_ptr self, Instruction inst)
 
     reg_write(inst.itype.rd, (uint64_t)val);
 
-    self->pc += 4;
+    PC += 4;
     dispatch();
 }
 
-ALWAYS_INLINE static bool handler_rv64_store(riscvm_ptr self, Instruction inst)
+ALWAYS_INLINE static bool handler_rv64_store(HANDLER_PARAMS)
 {
     int32_t  imm  = bit_signer((inst.stype.imm7 << 5) | inst.stype.imm5, 12);
     uint64_t addr = reg_read(inst.stype.rs1) + imm;
     uint64_t val  = reg_read(inst.stype.rs2);
+    spill_pc_for_fault();
     switch (inst.stype.funct3)
     {
     case rv64_store_sb:
     {
-        riscvm_write<uint8_t>(addr, (uint8_t)val);
+        riscvm_write<uint8_t>(self, addr, (uint8_t)val);
         break;
     }
     case rv64_store_sh:
     {
-        riscvm_write<uint16_t>(addr, (uint16_t)val);
+        riscvm_write<uint16_t>(self, addr, (uint16_t)val);
         break;
     }
     case rv64_store_sw:
     {
-        riscvm_write<uint32_t>(addr, (uint32_t)val);
+        riscvm_write<uint32_t>(self, addr, (uint32_t)val);
         break;
     }
     case rv64_store_sd:
     {
-        riscvm_write<uint64_t>(addr, val);
+        riscvm_write<uint64_t>(self, addr, val);
         break;
     }
     default:
@@ -436,11 +1318,11 @@ ALWAYS_INLINE static bool handler_rv64_store(riscvm_ptr self, Instruction inst)
     }
     }
 
-    self->pc += 4;
+    PC += 4;
     dispatch();
 }
 
-ALWAYS_INLINE static bool handler_rv64_imm64(riscvm_ptr self, Instruction inst)
+ALWAYS_INLINE static bool handler_rv64_imm64(HANDLER_PARAMS)
 {
     int64_t imm = bit_signer(inst.itype.imm, 12);
     int64_t val = reg_read(inst.itype.rs1);
@@ -518,11 +1400,11 @@ ALWAYS_INLINE static bool handler_rv64_imm64(riscvm_ptr self, Instruction inst)
 
     reg_write(inst.itype.rd, val);
 
-    self->pc += 4;
+    PC += 4;
     dispatch();
 }
 
-ALWAYS_INLINE static bool handler_rv64_imm32(riscvm_ptr self, Instruction inst)
+ALWAYS_INLINE static bool handler_rv64_imm32(HANDLER_PARAMS)
 {
     int64_t imm = bit_signer(inst.itype.imm, 12);
     int64_t val = reg_read(inst.itype.rs1);
@@ -561,11 +1443,11 @@ ALWAYS_INLINE static bool handler_rv64_imm32(riscvm_ptr self, Instruction inst)
 
     reg_write(inst.itype.rd, val);
 
-    self->pc += 4;
+    PC += 4;
     dispatch();
 }
 
-ALWAYS_INLINE static bool handler_rv64_op64(riscvm_ptr self, Instruction inst)
+ALWAYS_INLINE static bool handler_rv64_op64(HANDLER_PARAMS)
 {
     int64_t val1 = reg_read(inst.rtype.rs1);
     int64_t val2 = reg_read(inst.rtype.rs2);
@@ -729,11 +1611,11 @@ ALWAYS_INLINE static bool handler_rv64_op64(riscvm_ptr self, Instruction inst)
 
     reg_write(inst.rtype.rd, val);
 
-    self->pc += 4;
+    PC += 4;
     dispatch();
 }
 
-ALWAYS_INLINE static bool handler_rv64_op32(riscvm_ptr self, Instruction inst)
+ALWAYS_INLINE static bool handler_rv64_op32(HANDLER_PARAMS)
 {
     int64_t val1 = reg_read(inst.rtype.rs1);
     int64_t val2 = reg_read(inst.rtype.rs2);
@@ -843,29 +1725,29 @@ ALWAYS_INLINE static bool handler_rv64_op32(riscvm_ptr self, Instruction inst)
 
     reg_write(inst.rtype.rd, val);
 
-    self->pc += 4;
+    PC += 4;
     dispatch();
 }
 
-ALWAYS_INLINE static bool handler_rv64_lui(riscvm_ptr self, Instruction inst)
+ALWAYS_INLINE static bool handler_rv64_lui(HANDLER_PARAMS)
 {
     int64_t imm = bit_signer(inst.utype.imm, 20) << 12;
     reg_write(inst.utype.rd, imm);
 
-    self->pc += 4;
+    PC += 4;
     dispatch();
 }
 
-ALWAYS_INLINE static bool handler_rv64_auipc(riscvm_ptr self, Instruction inst)
+ALWAYS_INLINE static bool handler_rv64_auipc(HANDLER_PARAMS)
 {
     int64_t imm = bit_signer(inst.utype.imm, 20) << 12;
-    reg_write(inst.utype.rd, self->pc + imm);
+    reg_write(inst.utype.rd, PC + imm);
 
-    self->pc += 4;
+    PC += 4;
     dispatch();
 }
 
-ALWAYS_INLINE static bool handler_rv64_jal(riscvm_ptr self, Instruction inst)
+ALWAYS_INLINE static bool handler_rv64_jal(HANDLER_PARAMS)
 {
     int64_t imm = bit_signer(
         (inst.ujtype.imm20 << 20) | (inst.ujtype.imm1 << 1) | (inst.ujtype.imm11 << 11)
@@ -873,23 +1755,23 @@ ALWAYS_INLINE static bool handler_rv64_jal(riscvm_ptr self, Instruction inst)
         20
     );
 
-    reg_write(inst.ujtype.rd, self->pc + 4);
+    reg_write(inst.ujtype.rd, PC + 4);
 
-    self->pc += imm;
+    PC += imm;
     dispatch();
 }
 
-ALWAYS_INLINE static bool handler_rv64_jalr(riscvm_ptr self, Instruction inst)
+ALWAYS_INLINE static bool handler_rv64_jalr(HANDLER_PARAMS)
 {
-    auto    t   = self->pc + 4;
+    auto    t   = PC + 4;
     int32_t imm = bit_signer(inst.itype.imm, 12);
 
-    self->pc = (int64_t)(reg_read(inst.itype.rs1) + imm) & ~1;
+    PC = (int64_t)(reg_read(inst.itype.rs1) + imm) & ~1;
     reg_write(inst.itype.rd, t);
     dispatch();
 }
 
-ALWAYS_INLINE static bool handler_rv64_branch(riscvm_ptr self, Instruction inst)
+ALWAYS_INLINE static bool handler_rv64_branch(HANDLER_PARAMS)
 {
     int32_t imm = (inst.sbtype.imm_12 << 12) |  // Bit 31 -> Position 12
                   (inst.sbtype.imm_5_10 << 5) | // Bits 30-25 -> Positions 10-5
@@ -944,24 +1826,24 @@ ALWAYS_INLINE static bool handler_rv64_branch(riscvm_ptr self, Instruction inst)
 
     if (cond)
     {
-        self->pc += imm;
+        PC += imm;
     }
     else
     {
-        self->pc += 4;
+        PC += 4;
     }
     dispatch();
 }
 
-ALWAYS_INLINE static bool handler_rv64_fence(riscvm_ptr self, Instruction inst)
+ALWAYS_INLINE static bool handler_rv64_fence(HANDLER_PARAMS)
 {
     // no-op on x86
 
-    self->pc += 4;
+    PC += 4;
     dispatch();
 }
 
-ALWAYS_INLINE static bool handler_rv64_system(riscvm_ptr self, Instruction inst)
+ALWAYS_INLINE static bool handler_rv64_system(HANDLER_PARAMS)
 {
     switch (inst.itype.imm)
     {
@@ -977,19 +1859,41 @@ ALWAYS_INLINE static bool handler_rv64_system(riscvm_ptr self, Instruction inst)
 
         uint64_t code   = reg_read(reg_a7);
         uint64_t result = 0;
+#ifdef SYSCALL_HOOK
+        if (self->on_syscall != nullptr)
+        {
+            self->on_syscall(self, code);
+        }
+#endif // SYSCALL_HOOK
+        spill_pc();
 #ifdef CUSTOM_SYSCALLS
-        if (!self->handle_syscall(self, code, &result))
-            return false;
+        bool keep_running = self->handle_syscall(self, code, &result);
 #else
-        if (!riscvm_handle_syscall(self, code, result))
-            return false;
+        bool keep_running = riscvm_handle_syscall(self, code, result);
 #endif // CUSTOM_SYSCALLS
+        if (!keep_running)
+        {
+            // A yielding system call has completed, the guest continues after the ecall when resumed
+            if (self->status == riscvm_status_yield)
+            {
+                reg_write(reg_a0, result);
+                self->pc += 4;
+            }
+            else if (self->status == riscvm_status_running)
+            {
+                self->status = riscvm_status_exited;
+            }
+            return false;
+        }
+        reload_pc();
         reg_write(reg_a0, result);
         break;
     }
     case 0b000000000001: // ebreak
     {
+        spill_pc();
         reg_write(reg_a0, -1);
+        self->status = riscvm_status_exited;
         return false;
     }
     default:
@@ -999,26 +1903,104 @@ ALWAYS_INLINE static bool handler_rv64_system(riscvm_ptr self, Instruction inst)
     }
     }
 
-    self->pc += 4;
+    PC += 4;
     dispatch();
 }
 
-ALWAYS_INLINE static bool handler_rv64_invalid(riscvm_ptr self, Instruction inst)
+ALWAYS_INLINE static bool handler_rv64_invalid(HANDLER_PARAMS)
 {
+    spill_pc();
     panic("illegal instruction");
     return false;
 }
 
 #ifdef DIRECT_DISPATCH
-ALWAYS_INLINE static bool riscvm_execute(riscvm_ptr self, Instruction inst)
+ALWAYS_INLINE static bool riscvm_execute(riscvm_ptr self, int64_t pc)
 {
     dispatch();
 }
 
-NEVER_INLINE void riscvm_run(riscvm_ptr self)
+NEVER_INLINE static void riscvm_loop(riscvm_ptr self)
+{
+    riscvm_catch_faults();
+    riscvm_execute(self, self->pc);
+}
+#elif defined(THREADED_DISPATCH)
+#ifdef TRACING
+#define threaded_dispatch()                              \
+    check_budget();                                      \
+    inst.bits = riscvm_fetch(self, PC);                  \
+    if (inst.compressed_flags != 0b11)                   \
+    {                                                    \
+        panic("compressed instructions not supported!"); \
+    }                                                    \
+    if (g_trace)                                         \
+        riscvm_trace(self, inst);                        \
+    goto* labels[inst.opcode]
+#else
+#define threaded_dispatch()                              \
+    check_budget();                                      \
+    inst.bits = riscvm_fetch(self, PC);                  \
+    if (inst.compressed_flags != 0b11)                   \
+    {                                                    \
+        panic("compressed instructions not supported!"); \
+    }                                                    \
+    goto* labels[inst.opcode]
+#endif // TRACING
+
+// Every handler is inlined with its own copy of the dispatch, which gives the
+// host branch predictor one indirect jump per opcode instead of a shared one.
+static bool riscvm_execute(riscvm_ptr self)
 {
+    static_assert(rv64_load == 0b00000 && rv64_fence == 0b00011 && rv64_imm64 == 0b00100 && rv64_auipc == 0b00101 &&
+                      rv64_imm32 == 0b00110 && rv64_store == 0b01000 && rv64_op64 == 0b01100 && rv64_lui == 0b01101 &&
+                      rv64_op32 == 0b01110 && rv64_branch == 0b11000 && rv64_jalr == 0b11001 && rv64_jal == 0b11011 &&
+                      rv64_system == 0b11100,
+                  "labels does not match opcodes.h");
+
+    // Indexed by opcode, built once instead of on every call
+    static void* const labels[32] = {
+        &&label_rv64_load,    &&label_rv64_invalid, &&label_rv64_invalid, &&label_rv64_fence,   // 0b00000
+        &&label_rv64_imm64,   &&label_rv64_auipc,   &&label_rv64_imm32,   &&label_rv64_invalid, // 0b00100
+        &&label_rv64_store,   &&label_rv64_invalid, &&label_rv64_invalid, &&label_rv64_invalid, // 0b01000
+        &&label_rv64_op64,    &&label_rv64_lui,     &&label_rv64_op32,    &&label_rv64_invalid, // 0b01100
+        &&label_rv64_invalid, &&label_rv64_invalid, &&label_rv64_invalid, &&label_rv64_invalid, // 0b10000
+        &&label_rv64_invalid, &&label_rv64_invalid, &&label_rv64_invalid, &&label_rv64_invalid, // 0b10100
+        &&label_rv64_branch,  &&label_rv64_jalr,    &&label_rv64_invalid, &&label_rv64_jal,     // 0b11000
+        &&label_rv64_system,  &&label_rv64_invalid, &&label_rv64_invalid, &&label_rv64_invalid, // 0b11100
+    };
+
     Instruction inst;
-    riscvm_execute(self, inst);
+    threaded_dispatch();
+
+#define HANDLE(op)                   \
+    label_##op:                      \
+    if (!handler_##op(HANDLER_ARGS)) \
+        return false;                \
+    threaded_dispatch()
+    HANDLE(rv64_load);
+    HANDLE(rv64_fence);
+    HANDLE(rv64_imm64);
+    HANDLE(rv64_auipc);
+    HANDLE(rv64_imm32);
+    HANDLE(rv64_store);
+    HANDLE(rv64_op64);
+    HANDLE(rv64_lui);
+    HANDLE(rv64_op32);
+    HANDLE(rv64_branch);
+    HANDLE(rv64_jalr);
+    HANDLE(rv64_jal);
+    HANDLE(rv64_system);
+#undef HANDLE
+
+label_rv64_invalid:
+    return handler_rv64_invalid(HANDLER_ARGS);
+}
+
+NEVER_INLINE static void riscvm_loop(riscvm_ptr self)
+{
+    riscvm_catch_faults();
+    riscvm_execute(self);
 }
 #else
 ALWAYS_INLINE static bool riscvm_execute(riscvm_ptr self, Instruction inst)
@@ -1032,72 +2014,72 @@ ALWAYS_INLINE static bool riscvm_execute(riscvm_ptr self, Instruction inst)
     {
     case rv64_load:
     {
-        return handler_rv64_load(self, inst);
+        return handler_rv64_load(HANDLER_ARGS);
     }
 
     case rv64_store:
     {
-        return handler_rv64_store(self, inst);
+        return handler_rv64_store(HANDLER_ARGS);
     }
 
     case rv64_imm64:
     {
-        return handler_rv64_imm64(self, inst);
+        return handler_rv64_imm64(HANDLER_ARGS);
     }
 
     case rv64_imm32:
     {
-        return handler_rv64_imm32(self, inst);
+        return handler_rv64_imm32(HANDLER_ARGS);
     }
 
     case rv64_op64:
     {
-        return handler_rv64_op64(self, inst);
+        return handler_rv64_op64(HANDLER_ARGS);
     }
 
     case rv64_op32:
     {
-        return handler_rv64_op32(self, inst);
+        return handler_rv64_op32(HANDLER_ARGS);
     }
 
     case rv64_lui:
     {
-        return handler_rv64_lui(self, inst);
+        return handler_rv64_lui(HANDLER_ARGS);
     }
 
     case rv64_auipc:
     {
-        return handler_rv64_auipc(self, inst);
+        return handler_rv64_auipc(HANDLER_ARGS);
     }
 
     case rv64_jal: // call
     {
-        return handler_rv64_jal(self, inst);
+        return handler_rv64_jal(HANDLER_ARGS);
     }
 
     case rv64_jalr: // ret
     {
-        return handler_rv64_jalr(self, inst);
+        return handler_rv64_jalr(HANDLER_ARGS);
     }
 
     case rv64_branch:
     {
-        return handler_rv64_branch(self, inst);
+        return handler_rv64_branch(HANDLER_ARGS);
     }
 
     case rv64_fence:
     {
-        return handler_rv64_fence(self, inst);
+        return handler_rv64_fence(HANDLER_ARGS);
     }
 
     case rv64_system: // system calls and breakpoints
     {
-        return handler_rv64_system(self, inst);
+        return handler_rv64_system(HANDLER_ARGS);
     }
 
     default:
     {
-        return handler_rv64_invalid(self, inst);
+        return handler_rv64_invalid(HANDLER_ARGS);
     }
     }
 }
@@ -1106,13 +2088,22 @@ ALWAYS_INLINE static bool riscvm_execute(riscvm_ptr self, Instruction inst)
 #ifdef _MSC_VER
 __declspec(safebuffers)
 #endif // _MSC_VER
-NEVER_INLINE void
-riscvm_run(riscvm_ptr self)
+NEVER_INLINE static void
+riscvm_loop(riscvm_ptr self)
 {
+    riscvm_catch_faults();
     while (true)
     {
+#ifdef INSTRUCTION_BUDGET
+        if (UNLIKELY(self->budget-- <= 0))
+        {
+            self->status = riscvm_status_budget;
+            break;
+        }
+#endif // INSTRUCTION_BUDGET
+
         Instruction inst;
-        inst.bits = riscvm_fetch(self);
+        inst.bits = riscvm_fetch(self, PC);
 
 #ifdef TRACING
         if (g_trace)
@@ -1125,3 +2116,53 @@ riscvm_run(riscvm_ptr self)
     }
 }
 #endif // DIRECT_DISPATCH
+
+void riscvm_run(riscvm_ptr self)
+{
+    self->status = riscvm_status_running;
+    riscvm_loop(self);
+    // Everything that stops the guest without setting a status is a panic
+    if (self->status == riscvm_status_running)
+    {
+        self->status = riscvm_status_fault;
+    }
+}
+
+#ifdef INSTRUCTION_BUDGET
+riscvm_status riscvm_resume(riscvm_ptr self, int64_t budget, uint64_t timeout_us)
+{
+    if (timeout_us == 0)
+    {
+        self->budget = budget;
+        riscvm_run(self);
+        return self->status;
+    }
+
+    // The clock is only checked between slices to keep it out of the interpreter loop
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeout_us);
+    auto left     = budget;
+    while (true)
+    {
+        auto slice   = left < RISCVM_TIME_SLICE ? left : RISCVM_TIME_SLICE;
+        self->budget = slice;
+        riscvm_run(self);
+        left -= slice - (self->budget < 0 ? 0 : self->budget);
+        if (self->status != riscvm_status_budget)
+        {
+            self->budget = left;
+            break;
+        }
+        if (left <= 0)
+        {
+            self->budget = -1;
+            break;
+        }
+        if (std::chrono::steady_clock::now() >= deadline)
+        {
+            self->budget = left;
+            break;
+        }
+    }
+    return self->status;
+}
+#endif // INSTRUCTION_BUDGET
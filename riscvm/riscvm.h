@@ -72,6 +72,18 @@ extern bool g_trace;
 
 #endif // TRACING
 
+#if defined(SANDBOX_MEMORY) || defined(PAGED_MEMORY)
+// Guest code is untrusted here, whatever it does has to stop the guest and never the host
+#undef panic
+#define panic(...)                          \
+    do                                      \
+    {                                       \
+        log(__VA_ARGS__);                   \
+        self->status = riscvm_status_fault; \
+        return false;                       \
+    } while (0)
+#endif // SANDBOX_MEMORY || PAGED_MEMORY
+
 #define reg_read(idx) (int64_t)self->regs[idx]
 
 #define reg_write(idx, value)        \
@@ -83,10 +95,113 @@ extern bool g_trace;
         }                            \
     } while (0)
 
+#ifdef SANDBOX_MEMORY
+#pragma message("Sandboxed memory enabled")
+
+#include <setjmp.h>
+
+/*
+ * Guest addresses are offsets into a reserved region of RISCVM_SANDBOX_SIZE
+ * bytes and every access is masked into it, so the guest can never touch host
+ * memory. Accesses to the first RISCVM_SANDBOX_GUARD bytes (guest null pointer
+ * dereferences) and accesses that straddle the end stop the guest with a0 set
+ * to -1, like page faults. Both guards are also inaccessible on the host.
+ */
+#ifndef RISCVM_SANDBOX_BITS
+#define RISCVM_SANDBOX_BITS 28
+#endif // RISCVM_SANDBOX_BITS
+#define RISCVM_SANDBOX_SIZE  (1ull << RISCVM_SANDBOX_BITS)
+#define RISCVM_SANDBOX_MASK  (RISCVM_SANDBOX_SIZE - 1)
+#define RISCVM_SANDBOX_GUARD 0x10000ull
+
+// Suggested layout: code right after the null guard, stack at the end
+#define RISCVM_SANDBOX_CODE      RISCVM_SANDBOX_GUARD
+#define RISCVM_SANDBOX_STACK_TOP RISCVM_SANDBOX_SIZE
+#endif // SANDBOX_MEMORY
+
+#ifdef PAGED_MEMORY
+#pragma message("Paged memory enabled")
+
+#if defined(SANDBOX_MEMORY)
+#error PAGED_MEMORY and SANDBOX_MEMORY are mutually exclusive
+#endif // SANDBOX_MEMORY
+
+#include <setjmp.h>
+
+/*
+ * Guest addresses are translated through a two-level page table with
+ * per-page protections. Mapped pages are only committed (zero-filled) on
+ * their first access, so a guest can reserve gigabytes of address space
+ * while the resident memory stays proportional to what it touches. A small
+ * direct-mapped TLB in front of the page table keeps the common case to a
+ * compare and an add. Faults stop the guest with a0 set to -1.
+ */
+#ifndef RISCVM_PAGED_BITS
+#define RISCVM_PAGED_BITS 36
+#endif // RISCVM_PAGED_BITS
+#ifndef RISCVM_TLB_SIZE
+#define RISCVM_TLB_SIZE 256
+#endif // RISCVM_TLB_SIZE
+#define RISCVM_PAGED_SIZE   (1ull << RISCVM_PAGED_BITS)
+#define RISCVM_PAGE_BITS    12
+#define RISCVM_PAGE_SIZE    (1ull << RISCVM_PAGE_BITS)
+#define RISCVM_PAGE_OFFSET  (RISCVM_PAGE_SIZE - 1)
+#define RISCVM_PAGE_GUARD   0x10000ull
+
+// Suggested layout: code right after the null guard, stack at the end
+#define RISCVM_PAGED_CODE      RISCVM_PAGE_GUARD
+#define RISCVM_PAGED_STACK_TOP RISCVM_PAGED_SIZE
+
+enum riscvm_access
+{
+    riscvm_access_read,
+    riscvm_access_write,
+    riscvm_access_exec,
+};
+
+enum riscvm_protection
+{
+    riscvm_page_none  = 0,
+    riscvm_page_read  = 1 << riscvm_access_read,
+    riscvm_page_write = 1 << riscvm_access_write,
+    riscvm_page_exec  = 1 << riscvm_access_exec,
+};
+
+struct riscvm_tlb_entry
+{
+    // Page address | RISCVM_PAGE_OFFSET when the access is allowed, 0 otherwise
+    uint64_t  tag[3];
+    uintptr_t addend;
+};
+
+struct riscvm_page_table;
+#endif // PAGED_MEMORY
+
+enum riscvm_status
+{
+    riscvm_status_running,
+    riscvm_status_exited, // exit system call or ebreak
+    riscvm_status_budget, // out of instructions or past the deadline, resumable
+    riscvm_status_fault,  // illegal instruction, illegal system call or page fault
+    riscvm_status_yield,  // set by a system call handler that returns false, resumable
+};
+
 struct riscvm
 {
-    int64_t  pc;
-    uint64_t regs[32];
+    int64_t       pc;
+    uint64_t      regs[32];
+    riscvm_status status;
+
+#ifdef SANDBOX_MEMORY
+    uint8_t* memory;
+    jmp_buf* fault; // only valid during riscvm_run
+#endif // SANDBOX_MEMORY
+
+#ifdef PAGED_MEMORY
+    riscvm_tlb_entry          tlb[RISCVM_TLB_SIZE];
+    struct riscvm_page_table* pages;
+    jmp_buf*                  fault; // only valid during riscvm_run
+#endif // PAGED_MEMORY
 
 #ifdef TRACING
     FILE*   trace;
@@ -98,6 +213,22 @@ struct riscvm
     uint32_t key;
 #endif // CODE_ENCRYPTION
 
+#ifdef OPCODE_SHUFFLING
+    const struct riscvm_opcode_map* opcodes;
+#endif // OPCODE_SHUFFLING
+
+#ifdef INSTRUCTION_BUDGET
+    // Instructions left before riscvm_run returns, -1 when it returned because of the budget
+    int64_t budget;
+#endif // INSTRUCTION_BUDGET
+
+#ifdef SYSCALL_HOOK
+    // Called before every system call is handled, nullptr for none
+    void (*on_syscall)(riscvm* self, uint64_t code);
+    // Handles the system calls riscvm does not implement, nullptr makes them illegal
+    bool (*unknown_syscall)(riscvm* self, uint64_t code, uint64_t* result);
+#endif // SYSCALL_HOOK
+
 #ifdef CUSTOM_SYSCALLS
     void* userdata;
     bool (*handle_syscall)(riscvm* self, uint64_t code, uint64_t* result);
@@ -257,29 +388,137 @@ enum RegIndex
     reg_t6,
 };
 
+#include "opcodes.h"
+
 #ifdef OPCODE_SHUFFLING
 #pragma message("Opcode shuffling enabled")
-#include "shuffled_opcodes.h"
-#else
-#include "opcodes.h"
+
+/*
+ * Decoding tables embedded in shuffled payloads (see encrypt.py). Every table
+ * is indexed by the shuffled value and contains the original value, unused
+ * entries are 0xFF (0xFFFF for op64/op32). The op64/op32 tables are indexed by
+ * the shuffled (funct7 << 3) | funct3, which always fits in 5 bits.
+ */
+#pragma pack(push, 1)
+struct riscvm_encoded_map
+{
+    uint8_t  opcodes[32];
+    uint8_t  imm64[8];
+    uint8_t  imm32[8];
+    uint8_t  load[8];
+    uint8_t  store[8];
+    uint8_t  branch[8];
+    uint16_t op64[32];
+    uint16_t op32[32];
+};
+#pragma pack(pop)
+static_assert(sizeof(riscvm_encoded_map) == 200, "");
+
+/*
+ * Runtime opcode map, built from a riscvm_encoded_map by riscvm_load_opcode_map.
+ * After fetching an instruction the opcode and funct fields are replaced in a
+ * single table lookup, so the handlers only ever see the original encoding:
+ *
+ * bits = (bits & keep[opcode]) | remap[opcode][funct_index(bits) & funct[opcode]]
+ */
+struct riscvm_opcode_map
+{
+    uint32_t keep[32];
+    uint32_t funct[32];
+    uint32_t remap[32][32];
+};
 #endif // OPCODE_SHUFFLING
 
-template <typename T> ALWAYS_INLINE T riscvm_read(uint64_t addr)
+#ifdef PAGED_MEMORY
+// Slow path of guest memory accesses: fills the TLB, commits pages and raises faults
+NEVER_INLINE void riscvm_paged_access(riscvm_ptr self, uint64_t addr, void* data, uint64_t size, riscvm_access access);
+
+template <typename T> ALWAYS_INLINE void* riscvm_tlb_lookup(riscvm_ptr self, uint64_t addr, riscvm_access access)
+{
+    auto& entry = self->tlb[(addr >> RISCVM_PAGE_BITS) % RISCVM_TLB_SIZE];
+    if (LIKELY(entry.tag[access] == (addr | RISCVM_PAGE_OFFSET) && (addr & RISCVM_PAGE_OFFSET) <= RISCVM_PAGE_SIZE - sizeof(T)))
+    {
+        return (void*)(entry.addend + addr);
+    }
+    return nullptr;
+}
+
+template <typename T> ALWAYS_INLINE T riscvm_load(riscvm_ptr self, uint64_t addr, riscvm_access access)
 {
     T data;
-    memcpy(&data, (const void*)addr, sizeof(data));
+    if (auto ptr = riscvm_tlb_lookup<T>(self, addr, access))
+    {
+        memcpy(&data, ptr, sizeof(data));
+    }
+    else
+    {
+        riscvm_paged_access(self, addr, &data, sizeof(data), access);
+    }
     return data;
 }
 
-template <typename T> ALWAYS_INLINE void riscvm_write(uint64_t addr, T val)
+template <typename T> ALWAYS_INLINE T riscvm_read(riscvm_ptr self, uint64_t addr)
 {
-    memcpy((void*)addr, &val, sizeof(val));
+    return riscvm_load<T>(self, addr, riscvm_access_read);
 }
 
+template <typename T> ALWAYS_INLINE void riscvm_write(riscvm_ptr self, uint64_t addr, T val)
+{
+    if (auto ptr = riscvm_tlb_lookup<T>(self, addr, riscvm_access_write))
+    {
+        memcpy(ptr, &val, sizeof(val));
+    }
+    else
+    {
+        riscvm_paged_access(self, addr, &val, sizeof(val), riscvm_access_write);
+    }
+}
+#else
 ALWAYS_INLINE static void* riscvm_getptr(riscvm_ptr self, uint64_t addr)
 {
+#ifdef SANDBOX_MEMORY
+    return self->memory + (addr & RISCVM_SANDBOX_MASK);
+#else
     return (void*)addr;
+#endif // SANDBOX_MEMORY
+}
+
+#ifdef SANDBOX_MEMORY
+// Stops the guest and returns to the host from riscvm_run, a faulting fetch also becomes the pc
+NEVER_INLINE void riscvm_sandbox_fault(riscvm_ptr self, uint64_t addr, bool fetch);
+
+// A single compare covers both guards, offsets below RISCVM_SANDBOX_GUARD wrap around
+template <typename T> ALWAYS_INLINE void* riscvm_sandbox_access(riscvm_ptr self, uint64_t addr, bool fetch)
+{
+    auto offset = addr & RISCVM_SANDBOX_MASK;
+    if (UNLIKELY(offset - RISCVM_SANDBOX_GUARD > RISCVM_SANDBOX_SIZE - RISCVM_SANDBOX_GUARD - sizeof(T)))
+    {
+        riscvm_sandbox_fault(self, addr, fetch);
+    }
+    return self->memory + offset;
 }
+#endif // SANDBOX_MEMORY
+
+template <typename T> ALWAYS_INLINE T riscvm_read(riscvm_ptr self, uint64_t addr)
+{
+    T data;
+#ifdef SANDBOX_MEMORY
+    memcpy(&data, riscvm_sandbox_access<T>(self, addr, false), sizeof(data));
+#else
+    memcpy(&data, riscvm_getptr(self, addr), sizeof(data));
+#endif // SANDBOX_MEMORY
+    return data;
+}
+
+template <typename T> ALWAYS_INLINE void riscvm_write(riscvm_ptr self, uint64_t addr, T val)
+{
+#ifdef SANDBOX_MEMORY
+    memcpy(riscvm_sandbox_access<T>(self, addr, false), &val, sizeof(val));
+#else
+    memcpy(riscvm_getptr(self, addr), &val, sizeof(val));
+#endif // SANDBOX_MEMORY
+}
+#endif // PAGED_MEMORY
 
 ALWAYS_INLINE static int32_t bit_signer(uint32_t field, uint32_t size)
 {
@@ -292,4 +531,59 @@ ALWAYS_INLINE static int32_t bit_signer(uint32_t field, uint32_t size)
 #define DLLEXPORT
 #endif
 
+/*
+ * Optional system calls the host implements, passed to the guest in a0 when it
+ * starts. Guests built with lib/crt0.c only issue the ones advertised here, so
+ * hosts that leave a0 alone or implement their own system calls keep working.
+ */
+#define RISCVM_FEATURES_MAGIC       0x5256464500000000ull // 'RVFE' in the upper half, must match lib/crt0.c
+#define RISCVM_FEATURE_IMPORT_CACHE 0x1                   // import_cache_get/import_cache_set
+#if defined(_WIN32) && !defined(SANDBOX_MEMORY) && !defined(PAGED_MEMORY) && !defined(CUSTOM_SYSCALLS)
+#define RISCVM_HOST_FEATURES (RISCVM_FEATURES_MAGIC | RISCVM_FEATURE_IMPORT_CACHE)
+#else
+#define RISCVM_HOST_FEATURES RISCVM_FEATURES_MAGIC
+#endif // _WIN32 && !SANDBOX_MEMORY && !PAGED_MEMORY && !CUSTOM_SYSCALLS
+
+// Features trailer of an image, "FEAT" as written by encrypt.py
+#define RISCVM_IMAGE_FEATURES_MAGIC 0x54414546u
+
+// Runs until the guest stops, the reason is left in self->status
 extern "C" DLLEXPORT void riscvm_run(riscvm_ptr self);
+
+#ifdef INSTRUCTION_BUDGET
+#ifndef RISCVM_TIME_SLICE
+#define RISCVM_TIME_SLICE 0x10000
+#endif // RISCVM_TIME_SLICE
+
+/*
+ * Executes at most budget instructions, and when timeout_us is not zero,
+ * stops at the first RISCVM_TIME_SLICE boundary past the timeout. After
+ * riscvm_status_budget or riscvm_status_yield it can be called again to
+ * continue where the guest left off.
+ */
+extern "C" DLLEXPORT riscvm_status riscvm_resume(riscvm_ptr self, int64_t budget, uint64_t timeout_us);
+#endif // INSTRUCTION_BUDGET
+
+#ifdef SANDBOX_MEMORY
+// Returns nullptr when the region could not be reserved
+extern "C" DLLEXPORT uint8_t* riscvm_sandbox_alloc();
+// Zeroes the whole sandbox so it can be reused for another guest
+extern "C" DLLEXPORT bool     riscvm_sandbox_reset(uint8_t* memory);
+extern "C" DLLEXPORT void     riscvm_sandbox_free(uint8_t* memory);
+#endif // SANDBOX_MEMORY
+
+#ifdef PAGED_MEMORY
+// Sets the protection of the pages in [addr, addr + size), new pages are committed on first access
+extern "C" DLLEXPORT bool riscvm_paged_map(riscvm_ptr self, uint64_t addr, uint64_t size, uint32_t protection);
+// Copies host data into mapped guest memory regardless of the page protection
+extern "C" DLLEXPORT bool riscvm_paged_copy(riscvm_ptr self, uint64_t addr, const void* data, uint64_t size);
+// Copies mapped guest memory to the host regardless of the page protection
+extern "C" DLLEXPORT bool riscvm_paged_read(riscvm_ptr self, uint64_t addr, void* data, uint64_t size);
+// Releases the page table and all committed pages
+extern "C" DLLEXPORT void riscvm_paged_free(riscvm_ptr self);
+#endif // PAGED_MEMORY
+
+#ifdef OPCODE_SHUFFLING
+// Pass nullptr as the encoded map for payloads that are not shuffled
+extern "C" DLLEXPORT void riscvm_load_opcode_map(riscvm_opcode_map* map, const riscvm_encoded_map* encoded);
+#endif // OPCODE_SHUFFLING
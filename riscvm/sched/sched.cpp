@@ -0,0 +1,253 @@
+#include "sched.h"
+
+static thread_local riscvm_task* t_current      = nullptr;
+static thread_local size_t       t_worker_index = SIZE_MAX;
+
+riscvm_scheduler::riscvm_scheduler(size_t workers, size_t blocking_threads, int64_t slice) : m_slice(slice)
+{
+    if (workers == 0)
+    {
+        workers = 1;
+    }
+    for (size_t i = 0; i < workers; i++)
+    {
+        m_queues.push_back(std::make_unique<worker_queue>());
+    }
+    for (size_t i = 0; i < workers; i++)
+    {
+        m_workers.emplace_back(&riscvm_scheduler::worker_thread, this, i);
+    }
+    for (size_t i = 0; i < blocking_threads; i++)
+    {
+        m_blocking_threads.emplace_back(&riscvm_scheduler::blocking_thread, this);
+    }
+}
+
+riscvm_scheduler::~riscvm_scheduler()
+{
+    {
+        std::lock_guard<std::mutex> idle_lock(m_idle_mutex);
+        std::lock_guard<std::mutex> blocking_lock(m_blocking_mutex);
+        m_shutdown = true;
+    }
+    m_idle_cond.notify_all();
+    m_blocking_cond.notify_all();
+    for (auto& thread : m_workers)
+    {
+        thread.join();
+    }
+    for (auto& thread : m_blocking_threads)
+    {
+        thread.join();
+    }
+}
+
+bool riscvm_scheduler::spawn(riscvm_task* task, size_t max_active)
+{
+    auto active = m_active.load(std::memory_order_relaxed);
+    do
+    {
+        if (active >= max_active)
+        {
+            return false;
+        }
+    } while (!m_active.compare_exchange_weak(active, active + 1, std::memory_order_relaxed));
+
+    task->status = riscvm_status_running;
+    enqueue(task);
+    return true;
+}
+
+riscvm_task* riscvm_scheduler::current()
+{
+    return t_current;
+}
+
+bool riscvm_scheduler::block(std::function<uint64_t()> call)
+{
+    auto task = t_current;
+    if (task == nullptr)
+    {
+        return false;
+    }
+    task->blocking   = std::move(call);
+    task->vm->status = riscvm_status_yield;
+    return true;
+}
+
+void riscvm_scheduler::enqueue(riscvm_task* task)
+{
+    // Workers keep their own guests, everything else is spread round-robin
+    auto index = t_worker_index;
+    if (index >= m_queues.size())
+    {
+        index = m_next_queue.fetch_add(1, std::memory_order_relaxed) % m_queues.size();
+    }
+    {
+        auto&                       queue = *m_queues[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(task);
+        m_queued.fetch_add(1);
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_idle_mutex);
+    }
+    m_idle_cond.notify_one();
+}
+
+riscvm_task* riscvm_scheduler::dequeue(size_t index)
+{
+    // m_queued changes with the queues under their locks, while it is not zero a task is in one of them
+    // Round-robin over the own queue, steal from the back of the others
+    {
+        auto&                       queue = *m_queues[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty())
+        {
+            auto task = queue.tasks.front();
+            queue.tasks.pop_front();
+            m_queued.fetch_sub(1);
+            return task;
+        }
+    }
+    for (size_t i = 1; i < m_queues.size(); i++)
+    {
+        auto&                       queue = *m_queues[(index + i) % m_queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty())
+        {
+            auto task = queue.tasks.back();
+            queue.tasks.pop_back();
+            m_queued.fetch_sub(1);
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+void riscvm_scheduler::run(riscvm_task* task)
+{
+    // Checked before every slice, guests that keep yielding never stop on the budget
+    auto now = std::chrono::steady_clock::now();
+    if (now >= task->deadline)
+    {
+        finish(task, riscvm_status_budget);
+        return;
+    }
+
+    // The slice ends at the deadline too, give or take RISCVM_TIME_SLICE instructions
+    uint64_t timeout_us = 0;
+    if (task->deadline != std::chrono::steady_clock::time_point::max())
+    {
+        auto left  = std::chrono::duration_cast<std::chrono::microseconds>(task->deadline - now).count();
+        timeout_us = left > 0 ? (uint64_t)left : 1;
+    }
+
+    auto vm    = task->vm;
+    auto slice = task->budget < m_slice ? task->budget : m_slice;
+
+    t_current   = task;
+    auto status = riscvm_resume(vm, slice, timeout_us);
+    t_current   = nullptr;
+    task->budget -= slice - (vm->budget < 0 ? 0 : vm->budget);
+
+    switch (status)
+    {
+    case riscvm_status_budget:
+    {
+        if (task->budget <= 0 || std::chrono::steady_clock::now() >= task->deadline)
+        {
+            finish(task, riscvm_status_budget);
+        }
+        else
+        {
+            enqueue(task);
+        }
+        break;
+    }
+
+    case riscvm_status_yield:
+    {
+        if (task->blocking && m_blocking_threads.empty())
+        {
+            auto call        = std::move(task->blocking);
+            task->blocking   = nullptr;
+            vm->regs[reg_a0] = call();
+            enqueue(task);
+        }
+        else if (task->blocking)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_blocking_mutex);
+                m_blocking.push_back(task);
+            }
+            m_blocking_cond.notify_one();
+        }
+        else
+        {
+            enqueue(task);
+        }
+        break;
+    }
+
+    default:
+    {
+        finish(task, status);
+        break;
+    }
+    }
+}
+
+void riscvm_scheduler::finish(riscvm_task* task, riscvm_status status)
+{
+    task->status = status;
+    m_active.fetch_sub(1, std::memory_order_relaxed);
+    if (task->done)
+    {
+        task->done(*task);
+    }
+}
+
+void riscvm_scheduler::worker_thread(size_t index)
+{
+    t_worker_index = index;
+    while (!m_shutdown)
+    {
+        auto task = dequeue(index);
+        if (task == nullptr)
+        {
+            // Only a task enqueued after its queue was searched keeps m_queued up, the next search finds it
+            std::unique_lock<std::mutex> lock(m_idle_mutex);
+            m_idle_cond.wait(lock, [this] { return m_shutdown || m_queued.load() > 0; });
+            if (m_shutdown)
+            {
+                return;
+            }
+            continue;
+        }
+        run(task);
+    }
+}
+
+void riscvm_scheduler::blocking_thread()
+{
+    while (true)
+    {
+        riscvm_task* task = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(m_blocking_mutex);
+            m_blocking_cond.wait(lock, [this] { return m_shutdown || !m_blocking.empty(); });
+            if (m_shutdown)
+            {
+                return;
+            }
+            task = m_blocking.front();
+            m_blocking.pop_front();
+        }
+
+        auto call              = std::move(task->blocking);
+        task->blocking         = nullptr;
+        task->vm->regs[reg_a0] = call();
+        enqueue(task);
+    }
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../riscvm.h"
+
+#ifndef INSTRUCTION_BUDGET
+#error "The scheduler requires INSTRUCTION_BUDGET"
+#endif // INSTRUCTION_BUDGET
+
+// A guest scheduled as a green thread, owned by the caller until done is called
+struct riscvm_task
+{
+    riscvm* vm       = nullptr;
+    void*   userdata = nullptr;
+
+    // Limits for the whole run, the guest is stopped with riscvm_status_budget past either
+    int64_t                               budget   = INT64_MAX;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+
+    // Called on a worker thread once the guest exited, faulted or ran out of budget
+    std::function<void(riscvm_task& task)> done;
+    riscvm_status                          status = riscvm_status_running;
+
+    // Host call the guest is parked on, see riscvm_scheduler::block
+    std::function<uint64_t()> blocking;
+};
+
+/*
+ * Multiplexes many guests over a fixed set of worker threads. Every worker
+ * runs its guests for a slice of instructions at a time and puts them back
+ * at the end of its own queue, idle workers steal from the others. Guests
+ * that make a slow host call park on a separate set of blocking threads
+ * so they never hold up a worker.
+ */
+class riscvm_scheduler
+{
+    struct worker_queue
+    {
+        std::mutex               mutex;
+        std::deque<riscvm_task*> tasks;
+    };
+
+    int64_t                                    m_slice;
+    std::vector<std::unique_ptr<worker_queue>> m_queues;
+    std::vector<std::thread>                   m_workers;
+    std::atomic<size_t>                        m_queued{0};
+    std::atomic<size_t>                        m_active{0};
+    std::atomic<size_t>                        m_next_queue{0};
+    std::mutex                                 m_idle_mutex;
+    std::condition_variable                    m_idle_cond;
+
+    std::vector<std::thread>  m_blocking_threads;
+    std::deque<riscvm_task*>  m_blocking;
+    std::mutex                m_blocking_mutex;
+    std::condition_variable   m_blocking_cond;
+    std::atomic<bool>         m_shutdown{false};
+
+  public:
+    riscvm_scheduler(size_t workers, size_t blocking_threads, int64_t slice = RISCVM_TIME_SLICE * 16);
+    // Stops the threads, guests that did not finish are abandoned without calling done
+    ~riscvm_scheduler();
+
+    riscvm_scheduler(const riscvm_scheduler&)            = delete;
+    riscvm_scheduler& operator=(const riscvm_scheduler&) = delete;
+
+    // Returns false without scheduling the task when max_active guests are already running
+    bool spawn(riscvm_task* task, size_t max_active = SIZE_MAX);
+
+    // Guests that are running, runnable or parked
+    size_t active() const
+    {
+        return m_active.load(std::memory_order_relaxed);
+    }
+
+    // Runnable guests waiting for a worker
+    size_t queued() const
+    {
+        return m_queued.load(std::memory_order_relaxed);
+    }
+
+    // Task of the guest running on the calling thread, nullptr outside of the scheduler
+    static riscvm_task* current();
+
+    /*
+     * Called from a system call handler: parks the current guest and runs
+     * call on a blocking thread, its result ends up in a0. The handler has
+     * to return false afterwards. Returns false (and does nothing) when the
+     * calling thread is not running a scheduled guest.
+     */
+    static bool block(std::function<uint64_t()> call);
+
+  private:
+    void         enqueue(riscvm_task* task);
+    riscvm_task* dequeue(size_t index);
+    void         run(riscvm_task* task);
+    void         finish(riscvm_task* task, riscvm_status status);
+    void         worker_thread(size_t index);
+    void         blocking_thread();
+};
@@ -0,0 +1,286 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+
+#include "sched.h"
+
+#ifndef CUSTOM_SYSCALLS
+#error "custom syscalls are required for the scheduler tests"
+#endif // CUSTOM_SYSCALLS
+
+// li t0, 100000; 1: addi t0, t0, -1; bnez t0, 1b; li a7, 10000; ecall
+static const uint32_t g_countdown[] = {
+    0x000182B7, 0x6A02829B, 0xFFF28293, 0xFE029EE3, 0x000028B7, 0x7108889B, 0x00000073,
+};
+
+// li a7, 30000; ecall; li a7, 10000; ecall
+static const uint32_t g_block[] = {0x000078B7, 0x5308889B, 0x00000073, 0x000028B7, 0x7108889B, 0x00000073};
+
+// li a7, 30001; ecall; li a7, 10000; ecall
+static const uint32_t g_spawn[] = {0x000078B7, 0x5318889B, 0x00000073, 0x000028B7, 0x7108889B, 0x00000073};
+
+// 1: j 1b
+static const uint32_t g_loop[] = {0x0000006F};
+
+// 1: li a7, 30002; ecall; j 1b
+static const uint32_t g_yield_loop[] = {0x000078B7, 0x5328889B, 0x00000073, 0xFF5FF06F};
+
+struct guest
+{
+    riscvm          vm = {};
+    riscvm_task     task;
+    uint64_t        exit_code = 0;
+    std::thread::id exit_thread;
+
+    template <size_t Count> bool load(const uint32_t (&code)[Count]);
+
+    ~guest()
+    {
+#if defined(SANDBOX_MEMORY)
+        riscvm_sandbox_free(vm.memory);
+#elif defined(PAGED_MEMORY)
+        riscvm_paged_free(&vm);
+#endif // SANDBOX_MEMORY
+    }
+};
+
+static riscvm_scheduler*   g_scheduler;
+static std::vector<guest*> g_children;
+
+// Tasks report back here when they are done, the tests wait for all of them
+static std::mutex              g_done_mutex;
+static std::condition_variable g_done_cond;
+static size_t                  g_done;
+
+static bool handle_syscall(riscvm* self, uint64_t code, uint64_t* result)
+{
+    auto current = (guest*)riscvm_scheduler::current()->userdata;
+    switch (code)
+    {
+    case 10000: // exit
+    {
+        current->exit_code   = self->regs[reg_a0];
+        current->exit_thread = std::this_thread::get_id();
+        return false;
+    }
+
+    case 30000: // a slow host call
+    {
+        auto worker = std::this_thread::get_id();
+        return !riscvm_scheduler::block(
+            [worker]
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                return std::this_thread::get_id() != worker ? 7 : 0;
+            }
+        );
+    }
+
+    case 30001: // spawn the children from a worker, which queues all of them on its own queue
+    {
+        for (auto child : g_children)
+        {
+            g_scheduler->spawn(&child->task);
+        }
+        *result = 0;
+        return true;
+    }
+
+    case 30002: // yield without a host call
+    {
+        self->status = riscvm_status_yield;
+        *result      = 0;
+        return false;
+    }
+
+    default:
+    {
+        self->status = riscvm_status_fault;
+        return false;
+    }
+    }
+}
+
+template <size_t Count> bool guest::load(const uint32_t (&code)[Count])
+{
+    auto self = &vm;
+#if defined(SANDBOX_MEMORY)
+    self->memory = riscvm_sandbox_alloc();
+    if (self->memory == nullptr)
+    {
+        return false;
+    }
+    memcpy(self->memory + RISCVM_SANDBOX_CODE, code, sizeof(code));
+    self->pc = (int64_t)RISCVM_SANDBOX_CODE;
+#elif defined(PAGED_MEMORY)
+    if (!riscvm_paged_map(self, RISCVM_PAGED_CODE, sizeof(code), riscvm_page_read | riscvm_page_exec) ||
+        !riscvm_paged_copy(self, RISCVM_PAGED_CODE, code, sizeof(code)))
+    {
+        return false;
+    }
+    self->pc = (int64_t)RISCVM_PAGED_CODE;
+#else
+    self->pc = (int64_t)code;
+#endif // SANDBOX_MEMORY
+    self->handle_syscall = handle_syscall;
+
+    task.vm       = self;
+    task.userdata = this;
+    task.done     = [](riscvm_task&)
+    {
+        {
+            std::lock_guard<std::mutex> lock(g_done_mutex);
+            g_done++;
+        }
+        g_done_cond.notify_all();
+    };
+    return true;
+}
+
+static bool wait_done(size_t count)
+{
+    std::unique_lock<std::mutex> lock(g_done_mutex);
+    auto done = g_done_cond.wait_for(lock, std::chrono::seconds(10), [count] { return g_done == count; });
+    g_done    = 0;
+    return done;
+}
+
+// Children spawned from a worker start out on its queue, the other workers have to steal them
+static const char* test_stealing()
+{
+    guest spawner;
+    guest children[16];
+
+    // Declared last, so the workers are gone before the guests
+    riscvm_scheduler scheduler(4, 0, RISCVM_TIME_SLICE);
+    g_scheduler = &scheduler;
+    for (auto& child : children)
+    {
+        if (!child.load(g_countdown))
+        {
+            return "guest setup failed";
+        }
+        g_children.push_back(&child);
+    }
+    if (!spawner.load(g_spawn))
+    {
+        return "guest setup failed";
+    }
+    scheduler.spawn(&spawner.task);
+    auto done = wait_done(1 + g_children.size());
+    g_children.clear();
+    if (!done)
+    {
+        return "timed out";
+    }
+
+    std::set<std::thread::id> threads;
+    for (auto& child : children)
+    {
+        if (child.task.status != riscvm_status_exited)
+        {
+            return "child did not exit";
+        }
+        threads.insert(child.exit_thread);
+    }
+    if (threads.size() < 2)
+    {
+        return "no child was stolen";
+    }
+    return nullptr;
+}
+
+// The blocking call runs off the workers and its result is in a0 when the guest continues
+static const char* test_block()
+{
+    for (size_t blocking_threads : {0, 2})
+    {
+        guest            guests[4];
+        riscvm_scheduler scheduler(2, blocking_threads);
+        for (auto& blocked : guests)
+        {
+            if (!blocked.load(g_block))
+            {
+                return "guest setup failed";
+            }
+            scheduler.spawn(&blocked.task);
+        }
+        if (!wait_done(4))
+        {
+            return "timed out";
+        }
+
+        // Without blocking threads the call runs on the worker
+        uint64_t expected = blocking_threads != 0 ? 7 : 0;
+        for (auto& blocked : guests)
+        {
+            if (blocked.task.status != riscvm_status_exited || blocked.exit_code != expected)
+            {
+                return "wrong result of the blocking call";
+            }
+        }
+    }
+    return nullptr;
+}
+
+// Past the deadline guests stop with riscvm_status_budget, also the ones that keep yielding
+static const char* test_deadline()
+{
+    guest            loop;
+    guest            yield_loop;
+    riscvm_scheduler scheduler(2, 0);
+    if (!loop.load(g_loop) || !yield_loop.load(g_yield_loop))
+    {
+        return "guest setup failed";
+    }
+    auto deadline            = std::chrono::steady_clock::now() + std::chrono::milliseconds(50);
+    loop.task.deadline       = deadline;
+    yield_loop.task.deadline = deadline;
+    scheduler.spawn(&loop.task);
+    scheduler.spawn(&yield_loop.task);
+    if (!wait_done(2))
+    {
+        return "timed out";
+    }
+    if (loop.task.status != riscvm_status_budget || yield_loop.task.status != riscvm_status_budget)
+    {
+        return "guest did not stop at the deadline";
+    }
+    return nullptr;
+}
+
+int main()
+{
+    struct
+    {
+        const char* name;
+        const char* (*run)();
+    } tests[] = {
+        {"stealing", test_stealing},
+        {"block", test_block},
+        {"deadline", test_deadline},
+    };
+
+    auto total      = 0;
+    auto successful = 0;
+    for (const auto& test : tests)
+    {
+        printf("[%s] ", test.name);
+        fflush(stdout);
+        total++;
+        auto error = test.run();
+        if (error != nullptr)
+        {
+            printf("FAILURE (%s)\n", error);
+        }
+        else
+        {
+            puts("SUCCESS");
+            successful++;
+        }
+    }
+
+    printf("\n%d/%d tests successful (%.2f%%)\n", successful, total, successful * 1.0f / total * 100);
+    return successful == total ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,20 +1,6 @@
 import json
 import random
 
-def generate_obfuscated_enum(enum_name, obfuscated_opcodes, names, header_code, prefix=""):
-    enum_prefix = prefix
-    # if prefix empty use enum name lowercased
-    if not prefix:
-        enum_prefix = enum_name.lower()
-    header_code += f"enum {enum_name}\n"
-    header_code += "{\n"
-    for original, obfuscated in obfuscated_opcodes.items():
-        header_code += f"    {enum_prefix}_{names[original]} = 0b{int(obfuscated):05b}, // original 0b{original:05b}\n"
-    header_code += f"    {enum_prefix}_invalid = 0b11111, // placeholder\n"
-    header_code += "};\n"
-    header_code += "\n"
-    return header_code
-
 def generate_original_enum(enum_name, opcodes, header_code, prefix=""):
     enum_prefix = prefix
     # if prefix empty use enum name lowercased
@@ -54,18 +40,6 @@ def main():
     obfuscated_store, names_store = obfuscate_opcodes(opcodes_dict["rv64_store"])
     obfuscated_branch, names_branch = obfuscate_opcodes(opcodes_dict["rv64_branch"])
 
-    # Generate the shuffled header file
-    shuffle_header_code = "#pragma once\n\n"
-    shuffle_header_code += "#include <stdint.h>\n\n"
-    shuffle_header_code = generate_obfuscated_enum("RV64_Opcode", obfuscated_opcodes, names_opcodes, shuffle_header_code, "rv64")
-    shuffle_header_code = generate_obfuscated_enum("RV64_Op64", obfuscated_op64, names_op64, shuffle_header_code)
-    shuffle_header_code = generate_obfuscated_enum("RV64_Op32", obfuscated_op32, names_op32, shuffle_header_code)
-    shuffle_header_code = generate_obfuscated_enum("RV64_Imm64", obfuscated_imm64, names_imm64, shuffle_header_code)
-    shuffle_header_code = generate_obfuscated_enum("RV64_Imm32", obfuscated_imm32, names_imm32, shuffle_header_code)
-    shuffle_header_code = generate_obfuscated_enum("RV64_Load", obfuscated_load, names_load, shuffle_header_code)
-    shuffle_header_code = generate_obfuscated_enum("RV64_Store", obfuscated_store, names_store, shuffle_header_code)
-    shuffle_header_code = generate_obfuscated_enum("RV64_Branch", obfuscated_branch, names_branch, shuffle_header_code)
-    
     # Generate the original header file
     original_header_code = "#pragma once\n\n"
     original_header_code += "#include <stdint.h>\n\n"
@@ -78,11 +52,7 @@ def main():
     original_header_code = generate_original_enum("RV64_Store", opcodes_dict["rv64_store"], original_header_code)
     original_header_code = generate_original_enum("RV64_Branch", opcodes_dict["rv64_branch"], original_header_code)
 
-    # Generate the shuffled header file
-    with open("shuffled_opcodes.h", "wb") as f:
-        f.write(shuffle_header_code.encode("utf-8"))
-
-    
+    # The shuffled tables are embedded in the payload by encrypt.py and loaded at runtime
     with open("opcodes.h", "wb") as f:
         f.write(original_header_code.encode("utf-8"))
         
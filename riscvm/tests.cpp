@@ -1,5 +1,7 @@
+#include <algorithm>
 #include <cstddef>
 #include <memory>
+#include <string>
 #include <vector>
 #include <cstdlib>
 #include <cstring>
@@ -7,10 +9,8 @@
 #include "riscvm.h"
 #include "riscvm-code.h"
 #include "isa-tests/data.h"
-
-#ifdef OPCODE_SHUFFLING
-#error "opcode shuffling is not supported in tests"
-#endif // OPCODE_SHUFFLING
+#include "isa-tests/shuffled.h"
+#include "lib/exports.h"
 
 #ifdef CODE_ENCRYPTION
 #error "code encryption is not supported in tests"
@@ -20,6 +20,370 @@
 #error "custom syscalls are required for tests"
 #endif // CUSTOM_SYSCALLS
 
+// Export lookups of the guest library (lib/exports.h) against a synthetic PE image
+static const char* test_exports()
+{
+    std::vector<std::string> names = {"Forwarded", "LoadLibraryA", "VirtualAlloc", "ZwClose", "a", "ab"};
+    for (int i = 0; i < 600; i++)
+    {
+        names.push_back("Export" + std::to_string(i * 7919 % 1000));
+    }
+    std::sort(names.begin(), names.end());
+
+    const uint32_t directory_rva  = 0x1000;
+    const uint32_t directory_size = 0x8000;
+    const uint32_t count          = (uint32_t)names.size();
+    const uint32_t functions_rva  = directory_rva + 0x100;
+    const uint32_t names_rva      = functions_rva + 4 * count;
+    const uint32_t ordinals_rva   = names_rva + 4 * count;
+    const uint32_t strings_rva    = ordinals_rva + 2 * count;
+    const uint32_t forwarder_rva  = directory_rva + directory_size - 0x10;
+
+    std::vector<uint8_t> image(directory_rva + directory_size + 0x10 * count);
+    auto                 data = image.data();
+    auto                 u32  = [&](uint32_t offset) -> uint32_t&
+    {
+        return *(uint32_t*)(data + offset);
+    };
+
+    u32(0x3C)                 = 0x80;          // e_lfanew
+    u32(0x80 + 0x88)          = directory_rva; // DataDirectory[0]
+    u32(0x80 + 0x8C)          = directory_size;
+    u32(directory_rva + 0x18) = count; // NumberOfNames
+    u32(directory_rva + 0x1C) = functions_rva;
+    u32(directory_rva + 0x20) = names_rva;
+    u32(directory_rva + 0x24) = ordinals_rva;
+    strcpy((char*)data + forwarder_rva, "NTDLL.Forwarded");
+
+    // The ordinals are reversed to make sure they are followed
+    auto strings = strings_rva;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        auto ordinal                              = count - 1 - i;
+        auto function                             = directory_rva + directory_size + 0x10 * i;
+        u32(names_rva + 4 * i)                    = strings;
+        *(uint16_t*)(data + ordinals_rva + 2 * i) = (uint16_t)ordinal;
+        u32(functions_rva + 4 * ordinal)          = names[i] == "Forwarded" ? forwarder_rva : function;
+        strcpy((char*)data + strings, names[i].c_str());
+        strings += (uint32_t)names[i].size() + 1;
+    }
+    if (strings > forwarder_rva)
+    {
+        return "synthetic image too small";
+    }
+
+    riscvm_exports exports;
+    riscvm_exports_init(&exports, (uintptr_t)data);
+    std::vector<uint64_t> index(count);
+    riscvm_exports_build_index(&exports, index.data());
+    if (!std::is_sorted(index.begin(), index.end()))
+    {
+        return "index not sorted";
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const auto& name     = names[i];
+        uintptr_t   expected = name == "Forwarded" ? 0 : (uintptr_t)data + directory_rva + directory_size + 0x10 * i;
+        auto        found    = riscvm_exports_find_name(&exports, name.c_str());
+        if (found == RISCVM_EXPORT_NOT_FOUND || names[found] != name)
+        {
+            return "name lookup failed";
+        }
+        auto hash    = riscvm_exports_hash(name.c_str());
+        auto scanned = riscvm_exports_scan_hash(&exports, hash);
+        if (riscvm_exports_find_hash(&exports, index.data(), hash) != scanned)
+        {
+            return "hash lookup differs from the linear scan";
+        }
+        if (scanned != expected)
+        {
+            return "wrong export address";
+        }
+    }
+
+    for (auto missing : {"", "A", "Export", "Export1000", "ZwClose2", "b", "zz"})
+    {
+        if (riscvm_exports_find_name(&exports, missing) != RISCVM_EXPORT_NOT_FOUND)
+        {
+            return "found a missing name";
+        }
+        if (riscvm_exports_find_hash(&exports, index.data(), riscvm_exports_hash(missing)) != 0)
+        {
+            return "found a missing hash";
+        }
+    }
+    return nullptr;
+}
+
+#ifdef OPCODE_SHUFFLING
+// Original value -> shuffled value, the inverse of a decoding table
+template <typename T, size_t N> static uint32_t shuffle_field(const T (&decode)[N], uint32_t value)
+{
+    for (uint32_t i = 0; i < N; i++)
+    {
+        if (decode[i] == value)
+        {
+            return i;
+        }
+    }
+    return value;
+}
+
+// Shuffles like encrypt.py, with the tables that end up in the payload instead of the JSON
+static uint32_t shuffle_instruction(uint32_t bits, const riscvm_encoded_map& map)
+{
+    uint32_t opcode = (bits >> 2) & 0b11111;
+    uint32_t funct3 = (bits >> 12) & 0b111;
+    uint32_t funct7 = (bits >> 25) & 0b1111111;
+    switch (opcode)
+    {
+    case rv64_load:
+        funct3 = shuffle_field(map.load, funct3);
+        break;
+    case rv64_store:
+        funct3 = shuffle_field(map.store, funct3);
+        break;
+    case rv64_imm64:
+        funct3 = shuffle_field(map.imm64, funct3);
+        break;
+    case rv64_imm32:
+        funct3 = shuffle_field(map.imm32, funct3);
+        break;
+    case rv64_branch:
+        funct3 = shuffle_field(map.branch, funct3);
+        break;
+    case rv64_op64:
+    case rv64_op32:
+    {
+        auto funct10 = shuffle_field(opcode == rv64_op64 ? map.op64 : map.op32, funct3 | funct7 << 3);
+        funct3       = funct10 & 0b111;
+        funct7       = funct10 >> 3;
+        break;
+    }
+    default:
+        break;
+    }
+    opcode = shuffle_field(map.opcodes, opcode);
+    return (bits & 0x01FF8F83) | opcode << 2 | funct3 << 12 | funct7 << 25;
+}
+
+// Copy of an ISA test ELF with the instructions in its executable sections shuffled
+static std::vector<uint8_t> shuffle_elf(const uint8_t* data, uint64_t size, const riscvm_encoded_map& map)
+{
+    std::vector<uint8_t> elf(data, data + size);
+    auto                 read = [&](uint64_t offset, size_t width)
+    {
+        uint64_t value = 0;
+        memcpy(&value, elf.data() + offset, width);
+        return value;
+    };
+
+    auto section_offset = read(0x28, 8); // e_shoff
+    auto section_size   = read(0x3A, 2); // e_shentsize
+    auto section_count  = read(0x3C, 2); // e_shnum
+    for (uint64_t i = 0; i < section_count; i++)
+    {
+        auto header = section_offset + i * section_size;
+        if ((read(header + 0x08, 8) & 0x4) == 0) // SHF_EXECINSTR
+        {
+            continue;
+        }
+        auto start = read(header + 0x18, 8);
+        auto end   = start + read(header + 0x20, 8);
+        for (auto offset = start; offset + 4 <= end; offset += 4)
+        {
+            // Zero padding is not an instruction
+            auto bits = (uint32_t)read(offset, 4);
+            if ((bits & 0b11) == 0b11)
+            {
+                bits = shuffle_instruction(bits, map);
+                memcpy(elf.data() + offset, &bits, sizeof(bits));
+            }
+        }
+    }
+    return elf;
+}
+#endif // OPCODE_SHUFFLING
+
+// Runs an ISA test image, encoded is the riscvm_encoded_map of shuffled images
+static const char* run_isa_test(const Test& test, const uint8_t* data, const void* encoded)
+{
+    if (test.size > sizeof(g_code))
+    {
+        return "too big";
+    }
+
+    riscvm vm   = {};
+    auto   self = &vm;
+    reg_write(reg_a0, 0x1122334455667788);
+#ifdef SANDBOX_MEMORY
+    self->memory = riscvm_sandbox_alloc();
+    if (self->memory == nullptr)
+    {
+        return "sandbox allocation failed";
+    }
+    memcpy(self->memory + RISCVM_SANDBOX_CODE, data, test.size);
+    reg_write(reg_sp, RISCVM_SANDBOX_STACK_TOP - 0x10);
+    self->pc = (int64_t)RISCVM_SANDBOX_CODE + test.offset;
+#elif defined(PAGED_MEMORY)
+    // Everything past the image is reserved as demand-zero data and stack
+    auto data_start = (RISCVM_PAGED_CODE + test.size + RISCVM_PAGE_OFFSET) & ~RISCVM_PAGE_OFFSET;
+    if (!riscvm_paged_map(self, RISCVM_PAGED_CODE, test.size, riscvm_page_read | riscvm_page_write | riscvm_page_exec) ||
+        !riscvm_paged_map(self, data_start, RISCVM_PAGED_STACK_TOP - data_start, riscvm_page_read | riscvm_page_write) ||
+        !riscvm_paged_copy(self, RISCVM_PAGED_CODE, data, test.size))
+    {
+        riscvm_paged_free(self);
+        return "paged memory setup failed";
+    }
+    reg_write(reg_sp, RISCVM_PAGED_STACK_TOP - 0x10);
+    self->pc = (int64_t)RISCVM_PAGED_CODE + test.offset;
+#else
+    memset(g_code, 0, sizeof(g_code));
+    memcpy(g_code, data, test.size);
+    reg_write(reg_sp, (uint64_t)&g_stack[sizeof(g_stack) - 0x10]);
+    self->pc = (int64_t)g_code + test.offset;
+#endif // SANDBOX_MEMORY
+#ifdef OPCODE_SHUFFLING
+    static riscvm_opcode_map opcode_map;
+    riscvm_load_opcode_map(&opcode_map, (const riscvm_encoded_map*)encoded);
+    self->opcodes = &opcode_map;
+#endif // OPCODE_SHUFFLING
+    self->handle_syscall = [](riscvm* self, uint64_t code, uint64_t* result)
+    {
+        if (code != 0x5d)
+        {
+            printf("Unexpected syscall %llu (0x%llX)\n", code, code);
+        }
+        return false;
+    };
+#ifdef TRACING
+    g_trace             = true;
+    char tracename[256] = "";
+    sprintf(tracename, encoded != nullptr ? "%s-shuffled.trace" : "%s.trace", test.name);
+    self->trace  = fopen(tracename, "w");
+    self->rebase = -self->pc + test.address;
+#endif // TRACING
+    riscvm_run(self);
+#ifdef TRACING
+    fclose(self->trace);
+#endif // TRACING
+#if defined(SANDBOX_MEMORY)
+    riscvm_sandbox_free(self->memory);
+#elif defined(PAGED_MEMORY)
+    riscvm_paged_free(self);
+#endif // SANDBOX_MEMORY
+
+    static char error[64];
+    auto        status = (int)reg_read(reg_a0);
+    if (self->status != riscvm_status_exited)
+    {
+        snprintf(error, sizeof(error), "vm status: %d", (int)self->status);
+        return error;
+    }
+    if (status != 0)
+    {
+        snprintf(error, sizeof(error), "status: %d", status);
+        return error;
+    }
+    return nullptr;
+}
+
+#if defined(SANDBOX_MEMORY) || defined(PAGED_MEMORY)
+// Faulting guest code has to stop the guest (not the host) with the pc at the fault, the nop
+// in front makes sure the pc was not just left where the guest started
+enum fault_kind
+{
+    fault_memory,  // a0 is -1, the pc at the access
+    fault_fetch,   // a0 is -1, the pc at address 0
+    fault_illegal, // the pc at the instruction, trapping the host instead is a failure
+};
+
+static const char* run_fault_test(const uint32_t (&code)[3], fault_kind kind)
+{
+    riscvm vm   = {};
+    auto   self = &vm;
+#ifdef SANDBOX_MEMORY
+    self->memory = riscvm_sandbox_alloc();
+    if (self->memory == nullptr)
+    {
+        return "sandbox allocation failed";
+    }
+    memcpy(self->memory + RISCVM_SANDBOX_CODE, code, sizeof(code));
+    self->pc = (int64_t)RISCVM_SANDBOX_CODE;
+#else
+    if (!riscvm_paged_map(self, RISCVM_PAGED_CODE, sizeof(code), riscvm_page_read | riscvm_page_exec) ||
+        !riscvm_paged_copy(self, RISCVM_PAGED_CODE, code, sizeof(code)))
+    {
+        riscvm_paged_free(self);
+        return "paged memory setup failed";
+    }
+    self->pc = (int64_t)RISCVM_PAGED_CODE;
+#endif // SANDBOX_MEMORY
+#ifdef OPCODE_SHUFFLING
+    static riscvm_opcode_map opcode_map;
+    riscvm_load_opcode_map(&opcode_map, nullptr);
+    self->opcodes = &opcode_map;
+#endif // OPCODE_SHUFFLING
+    self->handle_syscall = [](riscvm* self, uint64_t code, uint64_t* result)
+    {
+        return false;
+    };
+    riscvm_run(self);
+#ifdef SANDBOX_MEMORY
+    riscvm_sandbox_free(self->memory);
+#else
+    riscvm_paged_free(self);
+#endif // SANDBOX_MEMORY
+    if (self->status != riscvm_status_fault)
+    {
+        return "guest did not fault";
+    }
+    if (kind != fault_illegal && reg_read(reg_a0) != (uint64_t)-1)
+    {
+        return "a0 not set to -1";
+    }
+#ifdef SANDBOX_MEMORY
+    int64_t fault_pc = kind == fault_fetch ? 0 : (int64_t)RISCVM_SANDBOX_CODE + 4;
+#else
+    int64_t fault_pc = kind == fault_fetch ? 0 : (int64_t)RISCVM_PAGED_CODE + 4;
+#endif // SANDBOX_MEMORY
+    if (self->pc != fault_pc)
+    {
+        return "pc not at the fault";
+    }
+    return nullptr;
+}
+
+// ld a0, 0(zero)
+static const char* test_null_fault()
+{
+    const uint32_t code[] = {0x00000013, 0x00003503, 0x00100073};
+    return run_fault_test(code, fault_memory);
+}
+
+// jalr zero, 0(zero)
+static const char* test_null_fetch()
+{
+    const uint32_t code[] = {0x00000013, 0x00000067, 0x00100073};
+    return run_fault_test(code, fault_fetch);
+}
+
+// An all-zero word, which is not a valid (uncompressed) instruction
+static const char* test_illegal_instruction()
+{
+    const uint32_t code[] = {0x00000013, 0x00000000, 0x00100073};
+    return run_fault_test(code, fault_illegal);
+}
+
+// wfi
+static const char* test_illegal_system()
+{
+    const uint32_t code[] = {0x00000013, 0x10500073, 0x00100073};
+    return run_fault_test(code, fault_illegal);
+}
+#endif // SANDBOX_MEMORY || PAGED_MEMORY
+
 int main(int argc, char** argv)
 {
 #ifndef DISABLE_FILTER
@@ -29,72 +393,91 @@ int main(int argc, char** argv)
         filter.push_back(argv[i]);
     }
 #endif
-    auto total      = 0;
-    auto successful = 0;
-    for (const auto& test : tests)
+    auto allowed = [&](const char* name)
     {
 #ifndef DISABLE_FILTER
         if (!filter.empty())
         {
-            auto allowed = false;
             for (const auto& white : filter)
             {
-                if (strcmp(test.name, white) == 0)
+                if (strcmp(name, white) == 0)
                 {
-                    allowed = true;
-                    break;
+                    return true;
                 }
             }
-            if (!allowed)
-                continue;
+            return false;
         }
 #endif
+        return true;
+    };
+    auto total      = 0;
+    auto successful = 0;
 
-        printf("[%s] ", test.name);
-        if (test.size > sizeof(g_code))
-        {
-            printf("ERROR (too big)\n");
-            continue;
-        }
-        total++;
-
-        memset(g_code, 0, sizeof(g_code));
-        memcpy(g_code, test.data, test.size);
-        riscvm vm   = {};
-        auto   self = &vm;
-        reg_write(reg_a0, 0x1122334455667788);
-        reg_write(reg_sp, (uint64_t)&g_stack[sizeof(g_stack) - 0x10]);
-        self->pc             = (int64_t)g_code + test.offset;
-        self->handle_syscall = [](riscvm* self, uint64_t code, uint64_t* result)
-        {
-            if (code != 0x5d)
-            {
-                printf("Unexpected syscall %llu (0x%llX)\n", code, code);
-            }
-            return false;
-        };
-#ifdef TRACING
-        g_trace             = true;
-        char tracename[256] = "";
-        sprintf(tracename, "%s.trace", test.name);
-        self->trace  = fopen(tracename, "w");
-        self->rebase = -self->pc + test.address;
-#endif // TRACING
-        riscvm_run(self);
-#ifdef TRACING
-        fclose(self->trace);
-#endif // TRACING
-        auto status = (int)reg_read(reg_a0);
-        if (status != 0)
+    auto report = [&](const char* error)
+    {
+        if (error != nullptr)
         {
-            printf("FAILURE (status: %d)\n", status);
+            printf("FAILURE (%s)\n", error);
         }
         else
         {
             successful++;
             printf("SUCCESS\n");
         }
+    };
+    for (const auto& test : tests)
+    {
+        if (allowed(test.name))
+        {
+            printf("[%s] ", test.name);
+            total++;
+            report(run_isa_test(test, test.data, nullptr));
+        }
+#ifdef OPCODE_SHUFFLING
+        // fence_i patches its own code with unshuffled instructions
+        auto shuffled_name = std::string(test.name) + "-shuffled";
+        if (allowed(shuffled_name.c_str()) && strcmp(test.name, "rv64ui-p-fence_i") != 0)
+        {
+            printf("[%s] ", shuffled_name.c_str());
+            total++;
+            auto encoded = (const riscvm_encoded_map*)shuffled_opcode_map;
+            auto data    = shuffle_elf(test.data, test.size, *encoded);
+            report(run_isa_test(test, data.data(), encoded));
+        }
+#endif // OPCODE_SHUFFLING
+    }
+    if (allowed("exports"))
+    {
+        printf("[exports] ");
+        total++;
+        report(test_exports());
+    }
+#if defined(SANDBOX_MEMORY) || defined(PAGED_MEMORY)
+    if (allowed("null_fault"))
+    {
+        printf("[null_fault] ");
+        total++;
+        report(test_null_fault());
+    }
+    if (allowed("null_fetch"))
+    {
+        printf("[null_fetch] ");
+        total++;
+        report(test_null_fetch());
+    }
+    if (allowed("illegal_instruction"))
+    {
+        printf("[illegal_instruction] ");
+        total++;
+        report(test_illegal_instruction());
+    }
+    if (allowed("illegal_system"))
+    {
+        printf("[illegal_system] ");
+        total++;
+        report(test_illegal_system());
     }
+#endif // SANDBOX_MEMORY || PAGED_MEMORY
     if (total == 0)
     {
         puts("No tests matched filter");
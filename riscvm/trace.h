@@ -41,43 +41,43 @@ void trace_load(riscvm_ptr self, Instruction inst, char* buffer)
     case rv64_load_lb:
     {
         memnomic = "lb";
-        val      = riscvm_read<int8_t>(addr);
+        val      = riscvm_read<int8_t>(self, addr);
         break;
     }
     case rv64_load_lh:
     {
         memnomic = "lh";
-        val      = riscvm_read<int16_t>(addr);
+        val      = riscvm_read<int16_t>(self, addr);
         break;
     }
     case rv64_load_lw:
     {
         memnomic = "lw";
-        val      = riscvm_read<int32_t>(addr);
+        val      = riscvm_read<int32_t>(self, addr);
         break;
     }
     case rv64_load_ld:
     {
         memnomic = "ld";
-        val      = riscvm_read<int64_t>(addr);
+        val      = riscvm_read<int64_t>(self, addr);
         break;
     }
     case rv64_load_lbu:
     {
         memnomic = "lbu";
-        val      = riscvm_read<uint8_t>(addr);
+        val      = riscvm_read<uint8_t>(self, addr);
         break;
     }
     case rv64_load_lhu:
     {
         memnomic = "lhu";
-        val      = riscvm_read<uint16_t>(addr);
+        val      = riscvm_read<uint16_t>(self, addr);
         break;
     }
     case rv64_load_lwu:
     {
         memnomic = "lwu";
-        val      = riscvm_read<uint32_t>(addr);
+        val      = riscvm_read<uint32_t>(self, addr);
         break;
     }
     default:
@@ -640,9 +640,11 @@ void trace_system(riscvm_ptr self, Instruction inst, char* buffer)
 
 void riscvm_trace(riscvm_ptr self, Instruction inst)
 {
+    // Only reached for instructions the dispatch accepted
     if (inst.compressed_flags != 0b11)
     {
-        panic("compressed instructions not supported!");
+        log("compressed instructions not supported!\n");
+        return;
     }
 
     char buffer[256];
@@ -0,0 +1,272 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/Support/Endian.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+
+/*
+Import name -> DLL name. Import maps are either text (name:dll per line, as
+written by extract-bc.py) or precompiled with -compile-importmap. The files
+stay mapped and names point into them. Text maps are indexed in a hash map with
+every DLL name stored once, binary maps are searched where they are mapped, so
+they load in constant time no matter how many exports they list.
+
+Binary format (little endian):
+    char     magic[4] = "RVIM"
+    uint32_t version
+    uint32_t dllCount
+    uint32_t importCount
+    uint32_t dlls[dllCount][2]       (offset, length) in strings
+    uint32_t imports[importCount][3] (offset, length) in strings, dll index, sorted by name
+    char     strings[]
+*/
+class ImportMap
+{
+    static constexpr char     binaryMagic[4] = {'R', 'V', 'I', 'M'};
+    static constexpr uint32_t binaryVersion  = 1;
+    static constexpr size_t   headerSize     = 16;
+
+    struct BinaryMap
+    {
+        const uint8_t*  dllTable;
+        uint32_t        dllCount;
+        const uint8_t*  importTable;
+        uint32_t        importCount;
+        llvm::StringRef strings;
+
+        // Empty when out of bounds, a corrupt file only makes lookups fail
+        llvm::StringRef string(const uint8_t* entry) const
+        {
+            uint64_t offset = llvm::support::endian::read32le(entry);
+            uint64_t length = llvm::support::endian::read32le(entry + 4);
+            return offset + length <= strings.size() ? strings.substr(offset, length) : llvm::StringRef();
+        }
+
+        llvm::StringRef lookup(llvm::StringRef name) const
+        {
+            uint32_t low  = 0;
+            uint32_t high = importCount;
+            while (low < high)
+            {
+                uint32_t mid   = low + (high - low) / 2;
+                auto     entry = importTable + mid * 12;
+                auto     order = string(entry).compare(name);
+                if (order == 0)
+                {
+                    uint32_t dllIndex = llvm::support::endian::read32le(entry + 8);
+                    return dllIndex < dllCount ? string(dllTable + dllIndex * 8) : llvm::StringRef();
+                }
+                if (order < 0)
+                {
+                    low = mid + 1;
+                }
+                else
+                {
+                    high = mid;
+                }
+            }
+            return llvm::StringRef();
+        }
+    };
+
+    std::vector<std::unique_ptr<llvm::MemoryBuffer>> buffers;
+    llvm::StringSet<>                                dlls;
+    llvm::DenseMap<llvm::StringRef, llvm::StringRef> imports;
+    std::vector<BinaryMap>                           binaryMaps;
+
+    llvm::StringRef intern(llvm::StringRef dll)
+    {
+        return dlls.insert(dll).first->getKey();
+    }
+
+    void add(llvm::StringRef name, llvm::StringRef dll, llvm::raw_ostream& log)
+    {
+        if (!imports.try_emplace(name, intern(dll)).second)
+        {
+            log << "[WARNING] Duplicate import " << name << "\n";
+        }
+    }
+
+    void loadText(llvm::StringRef data, llvm::raw_ostream& log)
+    {
+        // Roughly 24 bytes per line, reserving up front saves rehashing large maps
+        imports.reserve(imports.size() + data.size() / 24);
+        while (!data.empty())
+        {
+            llvm::StringRef line;
+            std::tie(line, data) = data.split('\n');
+            line                 = line.rtrim('\r');
+
+            auto colonIdx = line.find(':');
+            if (colonIdx == line.npos || colonIdx + 1 == line.size())
+            {
+                continue;
+            }
+            add(line.take_front(colonIdx), line.drop_front(colonIdx + 1), log);
+        }
+    }
+
+    bool loadBinary(llvm::StringRef data, llvm::raw_ostream& log)
+    {
+        using llvm::support::endian::read32le;
+
+        auto header = data.bytes_begin();
+        if (data.size() < headerSize || read32le(header + 4) != binaryVersion)
+        {
+            log << "Unsupported binary import map version\n";
+            return false;
+        }
+
+        BinaryMap map;
+        map.dllCount       = read32le(header + 8);
+        map.importCount    = read32le(header + 12);
+        uint64_t tableSize = (uint64_t)map.dllCount * 8 + (uint64_t)map.importCount * 12;
+        if (data.size() - headerSize < tableSize)
+        {
+            log << "Truncated binary import map\n";
+            return false;
+        }
+        map.dllTable    = header + headerSize;
+        map.importTable = map.dllTable + map.dllCount * 8;
+        map.strings     = data.drop_front(headerSize + tableSize);
+        binaryMaps.push_back(map);
+        return true;
+    }
+
+  public:
+    bool load(const std::string& path, llvm::raw_ostream& log)
+    {
+        auto buffer = llvm::MemoryBuffer::getFile(path, false, false);
+        if (!buffer)
+        {
+            log << "Failed to open import map: " << path << "\n";
+            return false;
+        }
+
+        auto data = (*buffer)->getBuffer();
+        buffers.push_back(std::move(*buffer));
+        if (data.starts_with(llvm::StringRef(binaryMagic, sizeof(binaryMagic))))
+        {
+            return loadBinary(data, log);
+        }
+        loadText(data, log);
+        return true;
+    }
+
+    bool saveBinary(const std::string& path, llvm::raw_ostream& log) const
+    {
+        using llvm::support::endian::write32le;
+
+        // Sorted for the binary search (and so the same imports always produce the same file)
+        std::vector<std::pair<llvm::StringRef, llvm::StringRef>> sortedImports(imports.begin(), imports.end());
+        for (const auto& map : binaryMaps)
+        {
+            for (uint32_t i = 0; i < map.importCount; i++)
+            {
+                auto name = map.string(map.importTable + i * 12);
+                sortedImports.emplace_back(name, map.lookup(name));
+            }
+        }
+        auto byName = [](const auto& a, const auto& b)
+        {
+            return a.first < b.first;
+        };
+        auto sameName = [](const auto& a, const auto& b)
+        {
+            return a.first == b.first;
+        };
+        // Stable, so an import that is in several maps keeps the DLL lookup would return
+        std::stable_sort(sortedImports.begin(), sortedImports.end(), byName);
+        sortedImports.erase(std::unique(sortedImports.begin(), sortedImports.end(), sameName), sortedImports.end());
+
+        std::string                                strings;
+        llvm::DenseMap<llvm::StringRef, uint32_t>  dllIndices;
+        std::vector<std::pair<uint32_t, uint32_t>> dllTable;
+        std::vector<std::array<uint32_t, 3>>       importTable;
+        for (const auto& [name, dll] : sortedImports)
+        {
+            auto [itr, inserted] = dllIndices.try_emplace(dll, (uint32_t)dllTable.size());
+            if (inserted)
+            {
+                dllTable.emplace_back((uint32_t)strings.size(), (uint32_t)dll.size());
+                strings += dll;
+            }
+            importTable.push_back({(uint32_t)strings.size(), (uint32_t)name.size(), itr->second});
+            strings += name;
+        }
+
+        std::string data(headerSize + dllTable.size() * 8 + importTable.size() * 12, '\0');
+        auto        ptr = data.data();
+        memcpy(ptr, binaryMagic, sizeof(binaryMagic));
+        write32le(ptr + 4, binaryVersion);
+        write32le(ptr + 8, (uint32_t)dllTable.size());
+        write32le(ptr + 12, (uint32_t)importTable.size());
+        ptr += headerSize;
+        for (const auto& [offset, length] : dllTable)
+        {
+            write32le(ptr, offset);
+            write32le(ptr + 4, length);
+            ptr += 8;
+        }
+        for (const auto& entry : importTable)
+        {
+            write32le(ptr, entry[0]);
+            write32le(ptr + 4, entry[1]);
+            write32le(ptr + 8, entry[2]);
+            ptr += 12;
+        }
+        data += strings;
+
+        std::error_code      EC;
+        llvm::raw_fd_ostream out(path, EC, llvm::sys::fs::OF_None);
+        if (EC)
+        {
+            log << "Failed to write import map: " << EC.message() << "\n";
+            return false;
+        }
+        out << data;
+        return true;
+    }
+
+    bool empty() const
+    {
+        return imports.empty() && binaryMaps.empty();
+    }
+
+    size_t count(llvm::StringRef name) const
+    {
+        return lookup(name).empty() ? 0 : 1;
+    }
+
+    // Empty for names that are not in the map, text maps take precedence over binary ones
+    llvm::StringRef lookup(llvm::StringRef name) const
+    {
+        auto itr = imports.find(name);
+        if (itr != imports.end())
+        {
+            return itr->second;
+        }
+        for (const auto& map : binaryMaps)
+        {
+            auto dll = map.lookup(name);
+            if (!dll.empty())
+            {
+                return dll;
+            }
+        }
+        return llvm::StringRef();
+    }
+};
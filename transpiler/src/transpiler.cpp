@@ -1,21 +1,34 @@
+#include <algorithm>
+#include <atomic>
 #include <cstdlib>
-#include <fstream>
+#include <functional>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <unordered_set>
 #include <unordered_map>
 
 #include "utility.hpp"
+#include "importmap.hpp"
 
 #include <llvm/Support/CommandLine.h>
 #include <llvm/TargetParser/Triple.h>
 #include <llvm/Demangle/Demangle.h>
+#include <llvm/IR/InlineAsm.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Verifier.h>
+#include <llvm/Passes/PassBuilder.h>
 
 using namespace llvm;
 
-static cl::opt<std::string> g_input("input", cl::desc("Input bitcode"), cl::Required);
-static cl::opt<std::string> g_importmap("importmap", cl::desc("Import map"));
-static cl::opt<std::string> g_output("output", cl::desc("Output bitcode"), cl::Required);
+static cl::list<std::string> g_input("input", cl::desc("Input bitcode (repeat to transpile a batch)"));
+static cl::opt<std::string>  g_importmap("importmap", cl::desc("Import map, text or binary (shared by the whole batch)"));
+static cl::opt<std::string>  g_compileimportmap("compile-importmap", cl::desc("Write -importmap in the binary format and exit"));
+static cl::list<std::string> g_output("output", cl::desc("Output bitcode (one per -input)"));
+static cl::opt<bool>         g_lazyimports("lazy-imports", cl::desc("Resolve imports on their first call instead of at startup"));
+static cl::opt<bool>         g_inlineimports("inline-imports", cl::desc("Inline import stubs into their callers (eager imports only)"));
+static cl::opt<unsigned>     g_optlevel("O", cl::desc("Optimize the transpiled module (0-3, 0 leaves it to clang)"), cl::Prefix, cl::init(0));
+static cl::opt<unsigned>     g_jobs("j", cl::desc("Modules transpiled in parallel (default: one per core)"), cl::init(0));
 
 constexpr uint32_t hash_x65599(const char* buffer, bool case_sensitive)
 {
@@ -38,49 +51,171 @@ constexpr uint32_t hash_x65599(const char* buffer, bool case_sensitive)
 #define hash_module(name) hash_x65599(name, false)
 #define hash_import(name) hash_x65599(name, true)
 
-using ImportMap = std::unordered_map<std::string, std::string>;
-
+/*
+Host calls with up to six arguments pass them in a1-a6 of the host_call_regs
+system call, so the guest does not have to store (and the host load) them.
+Wider calls go through riscvm_host_call and its 13 slot argument block, which
+is allocated once per function and shared by all of its host calls.
+*/
 class HostCall
 {
-    IRBuilder<>&        builder;
-    const size_t        hostCallArgCount = 13;
-    Function*           hostCallFn       = nullptr;
-    std::vector<Value*> hostCallArgPtrs;
-    AllocaInst*         hostCallArr;
+    static constexpr size_t   hostCallArgCount    = 13;
+    static constexpr size_t   hostCallRegCount    = 6;
+    static constexpr uint64_t hostCallRegsSyscall = 20004;
+
+    IRBuilder<>& builder;
+    Function*    hostCallFn  = nullptr;
+    AllocaInst*  hostCallArr = nullptr;
+
+    Value* CreateRegsCall(Value* address, const std::vector<Value*>& args, const Twine& name)
+    {
+        auto ptrTy   = PointerType::get(builder.getContext(), 0);
+        auto int64Ty = builder.getInt64Ty();
+
+        // a0: address (and the result), a1-a6: arguments, a7: system call number
+        std::string         constraints = "={x10},{x10}";
+        std::vector<Type*>  types       = {ptrTy};
+        std::vector<Value*> operands    = {address};
+        for (size_t i = 0; i < args.size(); i++)
+        {
+            constraints += ",{x" + std::to_string(11 + i) + "}";
+            types.push_back(int64Ty);
+            operands.push_back(args[i]);
+        }
+        constraints += ",{x17},~{memory}";
+        types.push_back(int64Ty);
+        operands.push_back(builder.getInt64(hostCallRegsSyscall));
+
+        auto asmTy = FunctionType::get(ptrTy, types, false);
+        return builder.CreateCall(asmTy, InlineAsm::get(asmTy, "scall", constraints, true), operands, name);
+    }
 
   public:
     HostCall(IRBuilder<>& builder, Function* hostCallFn) : builder(builder), hostCallFn(hostCallFn)
     {
-        hostCallArr = builder.CreateAlloca(
-            PointerType::get(builder.getContext(), 0),
-            ConstantInt::get(Type::getInt32Ty(builder.getContext()), hostCallArgCount),
-            "args"
-        );
     }
 
+    // Arguments are pointers or integers of at most 64 bits (zero extended)
     Value* CreateCall(Value* address, std::vector<Value*> args, const Twine& name)
     {
-        for (size_t i = 0; i < args.size(); i++)
-        {
-            if (i >= hostCallArgCount)
-                throw std::runtime_error("Illegal riscvm_host_call");
+        if (args.size() > hostCallArgCount)
+            throw std::runtime_error("Illegal riscvm_host_call");
 
-            if (i >= hostCallArgPtrs.size())
+        auto int64Ty = builder.getInt64Ty();
+        for (auto& arg : args)
+        {
+            if (arg->getType()->isPointerTy())
+            {
+                arg = builder.CreatePtrToInt(arg, int64Ty, arg->getName() + "_cast");
+            }
+            else if (arg->getType() != int64Ty)
             {
-                hostCallArgPtrs.push_back(builder.CreateGEP(
-                    PointerType::get(builder.getContext(), 0),
-                    hostCallArr,
-                    {ConstantInt::get(Type::getInt32Ty(builder.getContext()), i)},
-                    "arg" + std::to_string(i) + "_ptr"
-                ));
+                arg = builder.CreateZExt(arg, int64Ty, arg->getName() + "_zext");
             }
-            builder.CreateStore(args[i], hostCallArgPtrs[i]);
+        }
+
+        if (args.size() <= hostCallRegCount)
+        {
+            return CreateRegsCall(address, args, name);
+        }
+
+        if (hostCallArr == nullptr)
+        {
+            auto&       entryBlock = builder.GetInsertBlock()->getParent()->getEntryBlock();
+            IRBuilder<> entryBuilder(&entryBlock, entryBlock.begin());
+            hostCallArr = entryBuilder.CreateAlloca(ArrayType::get(int64Ty, hostCallArgCount), nullptr, "args");
+        }
+        for (size_t i = 0; i < args.size(); i++)
+        {
+            auto argPtr = builder.CreateConstInBoundsGEP2_32(
+                hostCallArr->getAllocatedType(), hostCallArr, 0, i, "arg" + std::to_string(i) + "_ptr"
+            );
+            builder.CreateStore(args[i], argPtr);
         }
         return builder.CreateCall(hostCallFn, {address, hostCallArr}, name);
     }
 };
 
-static void HandleImports(Module& module, const std::vector<Function*> importedFunctions, const ImportMap& importmap)
+// Marshals the arguments of an import stub into a host call to address and returns the result
+static void CreateImportCall(IRBuilder<>& builder, HostCall& hostCall, Function* function, Value* address)
+{
+    auto& context   = function->getContext();
+    auto  ptrSize   = function->getParent()->getDataLayout().getPointerSizeInBits();
+    auto  uintptrTy = IntegerType::get(context, ptrSize);
+
+    std::vector<Value*> args;
+    for (size_t i = 0; i < function->arg_size(); i++)
+    {
+        Value* arg   = function->getArg(i);
+        auto   argTy = arg->getType();
+        arg->setName("arg" + std::to_string(i));
+
+        if (argTy->isPointerTy())
+        {
+            args.push_back(arg);
+        }
+        else if (argTy->isIntegerTy())
+        {
+            // outs() << "  arg[" << i << "]: " << size << " <> " << ptrSize << "\n";
+            auto size = argTy->getPrimitiveSizeInBits().getFixedValue();
+            if (size > ptrSize)
+            {
+                throw std::runtime_error("Parameter type size bigger than pointer size: " + std::to_string(size));
+            }
+
+            // HostCall zero extends it
+            args.push_back(arg);
+        }
+        else
+        {
+            throw std::runtime_error("Unsupported import argument type");
+        }
+    }
+
+    auto retValue = hostCall.CreateCall(address, args, "return");
+
+    // TODO: cast that shit
+    auto returnTy = function->getReturnType();
+    if (returnTy->isVoidTy())
+    {
+        builder.CreateRetVoid();
+    }
+    else if (returnTy->isPointerTy())
+    {
+        builder.CreateRet(retValue);
+    }
+    else if (returnTy->isIntegerTy())
+    {
+        auto retCast = builder.CreatePtrToInt(retValue, uintptrTy, "return_cast");
+        auto size    = returnTy->getPrimitiveSizeInBits().getFixedValue();
+        if (size > ptrSize)
+        {
+            throw std::runtime_error("Return type size bigger than pointer size: " + std::to_string(size));
+        }
+        else if (size < ptrSize)
+        {
+            auto retTrunc = builder.CreateTrunc(retCast, returnTy, "return_trunc");
+            builder.CreateRet(retTrunc);
+        }
+        else
+        {
+            builder.CreateRet(retCast);
+        }
+    }
+    else
+    {
+        throw std::runtime_error("Unsupported return type");
+    }
+}
+
+static void HandleImports(
+    Module&                      module,
+    const std::vector<Function*> importedFunctions,
+    const ImportMap&             importmap,
+    bool                         lazy,
+    bool                         inlineStubs,
+    raw_ostream&                 log
+)
 {
     if (importedFunctions.empty())
     {
@@ -110,10 +245,8 @@ static void HandleImports(Module& module, const std::vector<Function*> importedF
 
     auto& context = module.getContext();
 
-    auto ptrTy     = PointerType::get(context, 0);
-    auto ptrSize   = module.getDataLayout().getPointerSizeInBits();
-    auto uintptrTy = IntegerType::get(context, ptrSize);
-    auto int32Ty   = Type::getInt32Ty(context);
+    auto ptrTy   = PointerType::get(context, 0);
+    auto int32Ty = Type::getInt32Ty(context);
 
     auto resolveDllTy = FunctionType::get(ptrTy, {int32Ty}, false);
     auto resolveDllFn = reservedFunction("riscvm_resolve_dll", resolveDllTy);
@@ -124,63 +257,144 @@ static void HandleImports(Module& module, const std::vector<Function*> importedF
     auto hostCallTy = FunctionType::get(ptrTy, {ptrTy, ptrTy}, false);
     auto hostCallFn = reservedFunction("riscvm_host_call", hostCallTy);
 
-    auto importsTy = FunctionType::get(Type::getVoidTy(context), false);
-    auto importsFn = reservedFunction("riscvm_imports", importsTy);
+    static std::unordered_set<uint32_t> alwaysLoadedHashes = {
+        hash_module("ntdll.dll"),
+        hash_module("kernel32.dll"),
+        hash_module("kernelbase.dll"),
+    };
+
+    auto dllNameString = [&](const std::string& name)
+    {
+        auto dllNameConst = ConstantDataArray::getString(context, name);
+        return new GlobalVariable(module, dllNameConst->getType(), true, GlobalValue::PrivateLinkage, dllNameConst, "str_" + name);
+    };
 
-    IRBuilder<> resolveBuilder(BasicBlock::Create(context, "entry", importsFn));
-    HostCall    hostCallRoot(resolveBuilder, hostCallFn);
+    /*
+    Eager imports resolve everything in riscvm_imports, which crt0 calls before
+    main. Lazy imports leave that to the stubs, which resolve (and cache) their
+    target on the first call. The DLL bases are cached the same way in getter
+    functions, so a DLL is only looked up (or loaded) once the first of its
+    imports is called.
+    */
+    std::function<Value*(IRBuilder<>&, const std::string&)> dllBase;
 
+    // Eager: riscvm_imports and the DLL bases in it
+    std::unique_ptr<IRBuilder<>>         resolveBuilder;
+    std::unique_ptr<HostCall>            hostCallRoot;
     Value*                               ptrLoadLibraryA = nullptr;
     std::unordered_map<uint32_t, Value*> baseValues;
 
-    auto loadLibrary = [&](const std::string& name) -> Value*
+    // Lazy: riscvm_base_* getters
+    std::unordered_map<uint32_t, Function*>       baseFunctions;
+    std::function<Function*(const std::string&)> baseFunction;
+
+    if (lazy)
     {
-        auto hash = hash_module(name.c_str());
-        auto itr  = baseValues.find(hash);
-        if (itr != baseValues.end())
+        baseFunction = [&](const std::string& name) -> Function*
         {
-            return itr->second;
-        }
+            auto hash = hash_module(name.c_str());
+            auto itr  = baseFunctions.find(hash);
+            if (itr != baseFunctions.end())
+            {
+                return itr->second;
+            }
+
+            auto baseTy   = FunctionType::get(ptrTy, false);
+            auto function = Function::Create(baseTy, GlobalValue::PrivateLinkage, "riscvm_base_" + name, module);
+            function->addFnAttr(Attribute::NoInline);
+            baseFunctions.emplace(hash, function);
 
-        static std::unordered_set<uint32_t> alwaysLoadedHashes = {
-            hash_module("ntdll.dll"),
-            hash_module("kernel32.dll"),
-            hash_module("kernelbase.dll"),
+            auto baseGlobal = new GlobalVariable(
+                module, ptrTy, false, GlobalValue::PrivateLinkage, ConstantPointerNull::get(ptrTy), name + "_base"
+            );
+
+            auto entryBlock   = BasicBlock::Create(context, "entry", function);
+            auto cachedBlock  = BasicBlock::Create(context, "cached", function);
+            auto resolveBlock = BasicBlock::Create(context, "resolve", function);
+
+            IRBuilder<> builder(entryBlock);
+            HostCall    hostCall(builder, hostCallFn);
+            auto        cached = builder.CreateLoad(ptrTy, baseGlobal, "cached_base");
+            builder.CreateCondBr(
+                builder.CreateIsNotNull(cached, "resolved"),
+                cachedBlock,
+                resolveBlock,
+                MDBuilder(context).createBranchWeights(2000, 1)
+            );
+
+            builder.SetInsertPoint(cachedBlock);
+            builder.CreateRet(cached);
+
+            builder.SetInsertPoint(resolveBlock);
+            Value* base = nullptr;
+            if (alwaysLoadedHashes.count(hash))
+            {
+                base = builder.CreateCall(resolveDllFn, {ConstantInt::get(int32Ty, hash)}, name + "_base");
+            }
+            else
+            {
+                // Only runs once per DLL, so LoadLibraryA itself is not cached
+                auto kernel32Base = builder.CreateCall(baseFunction("kernel32.dll"), {}, "kernel32.dll_base");
+                auto loadLibraryA = builder.CreateCall(
+                    resolveImportFn, {kernel32Base, ConstantInt::get(int32Ty, hash_import("LoadLibraryA"))}, "import_LoadLibraryA"
+                );
+                base = hostCall.CreateCall(loadLibraryA, {dllNameString(name)}, name + "_base");
+            }
+            builder.CreateStore(base, baseGlobal);
+            builder.CreateRet(base);
+            return function;
         };
 
-        auto valueName = name + "_base";
-        if (alwaysLoadedHashes.count(hash))
+        dllBase = [&](IRBuilder<>& builder, const std::string& name) -> Value*
         {
-            auto base = resolveBuilder.CreateCall(
-                resolveDllFn, {ConstantInt::get(int32Ty, hash_module(name.c_str()))}, valueName
-            );
-            baseValues.emplace(hash, base);
-            return base;
-        }
+            return builder.CreateCall(baseFunction(name), {}, name + "_base");
+        };
+    }
+    else
+    {
+        auto importsTy = FunctionType::get(Type::getVoidTy(context), false);
+        auto importsFn = reservedFunction("riscvm_imports", importsTy);
+
+        resolveBuilder = std::make_unique<IRBuilder<>>(BasicBlock::Create(context, "entry", importsFn));
+        hostCallRoot   = std::make_unique<HostCall>(*resolveBuilder, hostCallFn);
 
-        if (ptrLoadLibraryA == nullptr)
+        dllBase = [&](IRBuilder<>& builder, const std::string& name) -> Value*
         {
-            itr = baseValues.find(hash_module("kernel32.dll"));
-            if (itr == baseValues.end())
+            auto hash = hash_module(name.c_str());
+            auto itr  = baseValues.find(hash);
+            if (itr != baseValues.end())
             {
-                throw std::runtime_error("Trying to load library " + name + " without kernel32 base");
+                return itr->second;
             }
 
-            ptrLoadLibraryA = resolveBuilder.CreateCall(
-                resolveImportFn, {itr->second, ConstantInt::get(int32Ty, hash_import("LoadLibraryA"))}, "import_LoadLibraryA"
-            );
-        }
+            auto valueName = name + "_base";
+            if (alwaysLoadedHashes.count(hash))
+            {
+                auto base = builder.CreateCall(resolveDllFn, {ConstantInt::get(int32Ty, hash_module(name.c_str()))}, valueName);
+                baseValues.emplace(hash, base);
+                return base;
+            }
 
-        auto dllNameConst  = ConstantDataArray::getString(context, name);
-        auto dllNameGlobal = new GlobalVariable(
-            module, dllNameConst->getType(), true, GlobalValue::PrivateLinkage, dllNameConst, "str_" + name
-        );
-        auto base = hostCallRoot.CreateCall(ptrLoadLibraryA, {dllNameGlobal}, valueName);
-        baseValues.emplace(hash, base);
-        return base;
-    };
+            if (ptrLoadLibraryA == nullptr)
+            {
+                itr = baseValues.find(hash_module("kernel32.dll"));
+                if (itr == baseValues.end())
+                {
+                    throw std::runtime_error("Trying to load library " + name + " without kernel32 base");
+                }
 
-    auto kernel32_base = loadLibrary("kernel32.dll");
+                ptrLoadLibraryA = builder.CreateCall(
+                    resolveImportFn, {itr->second, ConstantInt::get(int32Ty, hash_import("LoadLibraryA"))}, "import_LoadLibraryA"
+                );
+            }
+
+            auto base = hostCallRoot->CreateCall(ptrLoadLibraryA, {dllNameString(name)}, valueName);
+            baseValues.emplace(hash, base);
+            return base;
+        };
+
+        dllBase(*resolveBuilder, "kernel32.dll");
+    }
 
     for (auto function : importedFunctions)
     {
@@ -195,28 +409,23 @@ static void HandleImports(Module& module, const std::vector<Function*> importedF
             throw std::runtime_error("Imported function not found in import map: " + importName);
         }
 
-        auto importDll = importmap.at(importName);
+        auto importDll = importmap.lookup(importName).str();
         if (function->getDLLStorageClass() != GlobalValue::DefaultStorageClass)
         {
             function->setDLLStorageClass(GlobalValue::DefaultStorageClass);
-            outs() << "[Import] ";
+            log << "[Import] ";
         }
         else
         {
-            outs() << "[MSVCRT] ";
+            log << "[MSVCRT] ";
         }
-        outs() << importDll << ":" << importName << "\n";
+        log << importDll << ":" << importName << "\n";
 
         if (function->isVarArg())
         {
             throw std::runtime_error("Unsupported vararg import " + importName);
         }
 
-        auto base = loadLibrary(importDll);
-        auto ptr  = resolveBuilder.CreateCall(
-            resolveImportFn, {base, ConstantInt::get(int32Ty, hash_import(importName.c_str()))}, "import_" + importName
-        );
-
         auto importGlobal = new GlobalVariable(
             module,
             ptrTy,
@@ -225,93 +434,81 @@ static void HandleImports(Module& module, const std::vector<Function*> importedF
             ConstantPointerNull::get(PointerType::get(context, 0)),
             "import_" + importName
         );
-
-        // Store the resolved address in the global
-        resolveBuilder.CreateStore(ptr, importGlobal);
+        auto importHash = ConstantInt::get(int32Ty, hash_import(importName.c_str()));
 
         // Create the import host call stub
-        IRBuilder<>         builder(BasicBlock::Create(module.getContext(), "entry", function));
-        HostCall            hostCall(builder, hostCallFn);
-        std::vector<Value*> args;
+        IRBuilder<> builder(BasicBlock::Create(module.getContext(), "entry", function));
+        HostCall    hostCall(builder, hostCallFn);
+        Value*      address = nullptr;
 
-        for (size_t i = 0; i < function->arg_size(); i++)
+        if (lazy)
         {
-            Value* arg     = function->getArg(i);
-            auto   argTy   = arg->getType();
-            auto   argName = "arg" + std::to_string(i);
+            auto cached = builder.CreateLoad(ptrTy, importGlobal, "cached_address");
+
+            auto resolveBlock = BasicBlock::Create(context, "resolve", function);
+            auto callBlock    = BasicBlock::Create(context, "call", function);
+            builder.CreateCondBr(
+                builder.CreateIsNotNull(cached, "resolved"),
+                callBlock,
+                resolveBlock,
+                MDBuilder(context).createBranchWeights(2000, 1)
+            );
 
-            if (argTy->isPointerTy())
-            {
-                args.push_back(arg);
-            }
-            else if (argTy->isIntegerTy())
-            {
-                // outs() << "  arg[" << i << "]: " << size << " <> " << ptrSize << "\n";
-                auto size = argTy->getPrimitiveSizeInBits().getFixedValue();
-                if (size > ptrSize)
-                {
-                    throw std::runtime_error(
-                        "Parameter type size bigger than pointer size: " + std::to_string(size)
-                    );
-                }
-                else if (size < ptrSize)
-                {
-                    arg = builder.CreateZExt(arg, uintptrTy, argName + "_zext");
-                }
+            // Resolve on the first call and store the address for the next ones
+            builder.SetInsertPoint(resolveBlock);
+            auto base = dllBase(builder, importDll);
+            auto ptr  = builder.CreateCall(resolveImportFn, {base, importHash}, "import_" + importName);
+            builder.CreateStore(ptr, importGlobal);
+            builder.CreateBr(callBlock);
+
+            builder.SetInsertPoint(callBlock);
+            auto phi = builder.CreatePHI(ptrTy, 2, "import_address");
+            phi->addIncoming(cached, cached->getParent());
+            phi->addIncoming(ptr, resolveBlock);
+            address = phi;
+        }
+        else
+        {
+            auto base = dllBase(*resolveBuilder, importDll);
+            auto ptr  = resolveBuilder->CreateCall(resolveImportFn, {base, importHash}, "import_" + importName);
 
-                auto castValue = builder.CreateIntToPtr(arg, ptrTy, argName + "_cast");
-                args.push_back(castValue);
-            }
-            else
+            // Store the resolved address in the global
+            resolveBuilder->CreateStore(ptr, importGlobal);
+
+            auto load = builder.CreateLoad(ptrTy, importGlobal, "import_address");
+            if (inlineStubs)
             {
-                throw std::runtime_error("Unsupported import argument type");
+                // !invariant.load needs the global to hold the same value wherever the load runs. The global
+                // is private and riscvm_imports is the only function that writes it. crt0 calls riscvm_imports
+                // before the init arrays and main, so no stub runs while it is still null. Loops can then
+                // hoist the load across the host calls (tests/invariant-imports.ll).
+                load->setMetadata(LLVMContext::MD_invariant_load, MDNode::get(context, {}));
             }
+            address = load;
         }
 
-        auto address  = builder.CreateLoad(ptrTy, importGlobal, "import_address");
-        auto retValue = hostCall.CreateCall(address, args, "return");
+        CreateImportCall(builder, hostCall, function, address);
 
-        // TODO: cast that shit
-        auto returnTy = function->getReturnType();
-        if (returnTy->isVoidTy())
+        // Lazy stubs resolve and store the address themselves, inlining them only bloats the callers
+        if (inlineStubs && !lazy)
         {
-            builder.CreateRetVoid();
-        }
-        else if (returnTy->isPointerTy())
-        {
-            builder.CreateRet(retValue);
-        }
-        else if (returnTy->isIntegerTy())
-        {
-            auto retCast = builder.CreatePtrToInt(retValue, uintptrTy, "return_cast");
-            auto size    = returnTy->getPrimitiveSizeInBits().getFixedValue();
-            if (size > ptrSize)
-            {
-                throw std::runtime_error("Return type size bigger than pointer size: " + std::to_string(size));
-            }
-            else if (size < ptrSize)
-            {
-                auto retTrunc = builder.CreateTrunc(retCast, returnTy, "return_trunc");
-                builder.CreateRet(retTrunc);
-            }
-            else
-            {
-                builder.CreateRet(retCast);
-            }
+            function->addFnAttr(Attribute::AlwaysInline);
         }
         else
         {
-            throw std::runtime_error("Unsupported return type");
+            function->addFnAttr(Attribute::NoInline);
         }
-
-        // Prevent the import stub from being inlined
-        function->addFnAttr(Attribute::NoInline);
     }
 
-    resolveBuilder.CreateRetVoid();
+    if (resolveBuilder)
+    {
+        resolveBuilder->CreateRetVoid();
+    }
 }
 
-static void ProcessModule(Module& module, const ImportMap& importmap)
+static void ProcessModule(
+    Module& module, const ImportMap& importmap, bool lazyImports, bool inlineImports, raw_ostream& log
+)
 {
     Triple triple(module.getTargetTriple());
     if (triple.getArch() != Triple::x86_64)
@@ -359,7 +556,7 @@ static void ProcessModule(Module& module, const ImportMap& importmap)
         {
             importedFunctions.push_back(&function);
         }
-        else if (function.isDeclaration() && importmap.count(name.str()) != 0)
+        else if (function.isDeclaration() && importmap.count(name) != 0)
         {
             importedFunctions.push_back(&function);
         }
@@ -401,7 +598,7 @@ static void ProcessModule(Module& module, const ImportMap& importmap)
         }
     }
 
-    HandleImports(module, importedFunctions, importmap);
+    HandleImports(module, importedFunctions, importmap, lazyImports, inlineImports, log);
 
     // NOTE: enable if encountered
 #if 0
@@ -417,7 +614,7 @@ static void ProcessModule(Module& module, const ImportMap& importmap)
             }
             else
             {
-                llvm::outs() << "UNSUPPORTED: " << *user << "\n";
+                log << "UNSUPPORTED: " << *user << "\n";
                 throw std::runtime_error("Unsupported user of __ImageBase");
             }
         }
@@ -453,65 +650,155 @@ static void ProcessModule(Module& module, const ImportMap& importmap)
     }
 }
 
-int main(int argc, char** argv)
+/*
+Every guest instruction costs an interpreter dispatch, so this pipeline trades
+code size for fewer executed instructions: size attributes from the original
+build are dropped and the inliner is more aggressive. There is no vector
+extension in rv64im, so vectorization only adds code.
+*/
+static void OptimizeModule(Module& module, unsigned level)
 {
-    // Parse command line
-    cl::ParseCommandLineOptions(argc, argv);
+    for (Function& function : module.functions())
+    {
+        function.removeFnAttr(Attribute::OptimizeForSize);
+        function.removeFnAttr(Attribute::MinSize);
+    }
+
+    PipelineTuningOptions tuning;
+    tuning.LoopUnrolling     = level >= 2;
+    tuning.LoopInterleaving  = false;
+    tuning.LoopVectorization = false;
+    tuning.SLPVectorization  = false;
+    tuning.InlinerThreshold  = level >= 3 ? 500 : 325;
+
+    LoopAnalysisManager     loopAnalysis;
+    FunctionAnalysisManager functionAnalysis;
+    CGSCCAnalysisManager    cgsccAnalysis;
+    ModuleAnalysisManager   moduleAnalysis;
+
+    PassBuilder passBuilder(nullptr, tuning);
+    passBuilder.registerModuleAnalyses(moduleAnalysis);
+    passBuilder.registerCGSCCAnalyses(cgsccAnalysis);
+    passBuilder.registerFunctionAnalyses(functionAnalysis);
+    passBuilder.registerLoopAnalyses(loopAnalysis);
+    passBuilder.crossRegisterProxies(loopAnalysis, functionAnalysis, cgsccAnalysis, moduleAnalysis);
+
+    static const OptimizationLevel levels[] = {
+        OptimizationLevel::O0,
+        OptimizationLevel::O1,
+        OptimizationLevel::O2,
+        OptimizationLevel::O3,
+    };
+    auto passes = passBuilder.buildPerModuleDefaultPipeline(levels[level]);
+    passes.run(module, moduleAnalysis);
+}
 
-    // Load module
+static bool TranspileModule(const std::string& input, const std::string& output, const ImportMap& importmap, raw_ostream& log)
+{
+    // Every module gets its own context, so modules can be transpiled in parallel
     LLVMContext context;
-    auto        module = LoadModule(context, g_input);
+    auto        module = LoadModule(context, input, log);
+    if (!module)
+    {
+        return false;
+    }
 
-    // Load import map
-    ImportMap importmap;
-    if (!g_importmap.empty())
+    try
     {
-        std::ifstream file(g_importmap);
-        if (!file.is_open())
+        ProcessModule(*module, importmap, g_lazyimports, g_inlineimports, log);
+        if (verifyModule(*module, &log))
         {
-            outs() << "Failed to open import map: " << g_importmap << "\n";
-            return EXIT_FAILURE;
+            return false;
         }
-
-        std::string line;
-        while (std::getline(file, line))
+        if (g_optlevel != 0)
         {
-            auto colonIdx = line.find(':');
-            if (colonIdx == line.npos || colonIdx + 1 == line.size())
-            {
-                continue;
-            }
-
-            auto name = line.substr(0, colonIdx);
-            auto dll  = line.substr(colonIdx + 1);
-            if (importmap.count(name) != 0)
-            {
-                outs() << "[WARNING] Duplicate import " << name << "\n";
-            }
-            else
-            {
-                importmap[name] = dll;
-            }
+            OptimizeModule(*module, g_optlevel);
         }
     }
+    catch (const std::exception& x)
+    {
+        log << x.what() << "\n";
+        return false;
+    }
 
-    // Process module
-    try
+    return SaveModule(module.get(), output, log);
+}
+
+int main(int argc, char** argv)
+{
+    // Parse command line
+    cl::ParseCommandLineOptions(argc, argv);
+    if (g_compileimportmap.empty() && g_input.empty())
     {
-        ProcessModule(*module, importmap);
-        if (verifyModule(*module, &outs()))
-        {
-            return EXIT_FAILURE;
-        }
+        outs() << "No -input specified\n";
+        return EXIT_FAILURE;
     }
-    catch (const std::exception& x)
+    if (g_input.size() != g_output.size())
+    {
+        outs() << "Every -input needs exactly one -output\n";
+        return EXIT_FAILURE;
+    }
+    if (g_optlevel > 3)
     {
-        outs() << x.what() << "\n";
+        outs() << "Invalid optimization level -O" << g_optlevel << "\n";
         return EXIT_FAILURE;
     }
+    if (g_inlineimports && g_lazyimports)
+    {
+        outs() << "[WARNING] -inline-imports has no effect with -lazy-imports\n";
+    }
+
+    // Load import map
+    ImportMap importmap;
+    if (!g_importmap.empty() && !importmap.load(g_importmap, outs()))
+    {
+        return EXIT_FAILURE;
+    }
+    if (!g_compileimportmap.empty())
+    {
+        return importmap.saveBinary(g_compileimportmap, outs()) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (g_input.size() == 1)
+    {
+        return TranspileModule(g_input[0], g_output[0], importmap, outs()) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Batch: workers pick the next module, its log is printed in one piece when it is done
+    size_t threadCount = g_jobs != 0 ? g_jobs : std::max(1u, std::thread::hardware_concurrency());
+    threadCount        = std::min(threadCount, g_input.size());
 
-    // Save module
-    SaveModule(module.get(), g_output);
+    std::atomic<size_t>      next{0};
+    std::atomic<bool>        failed{false};
+    std::mutex               logMutex;
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < threadCount; i++)
+    {
+        workers.emplace_back(
+            [&]
+            {
+                for (size_t job; (job = next.fetch_add(1)) < g_input.size();)
+                {
+                    std::string        text;
+                    raw_string_ostream log(text);
+                    auto               success = TranspileModule(g_input[job], g_output[job], importmap, log);
+                    if (!success)
+                    {
+                        failed = true;
+                        log << "Failed to transpile " << g_input[job] << "\n";
+                    }
+
+                    std::lock_guard<std::mutex> lock(logMutex);
+                    outs() << log.str();
+                    outs().flush();
+                }
+            }
+        );
+    }
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
 
-    return EXIT_SUCCESS;
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
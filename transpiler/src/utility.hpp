@@ -14,20 +14,20 @@
 #include <llvm/IR/Instructions.h>
 #include <llvm/Bitcode/BitcodeWriter.h>
 
-inline std::unique_ptr<llvm::Module> LoadModule(llvm::LLVMContext& Context, const std::string& Filename)
+inline std::unique_ptr<llvm::Module>
+LoadModule(llvm::LLVMContext& Context, const std::string& Filename, llvm::raw_ostream& Log = llvm::errs())
 {
     llvm::SMDiagnostic Err;
     auto               M = llvm::parseIRFile(Filename, Err, Context);
     if (!M)
     {
-        llvm::errs() << "Failed to parse IR: " << Err.getMessage() << "\n";
-        llvm::errs().flush();
-        std::exit(EXIT_FAILURE);
+        Log << "Failed to parse IR: " << Err.getMessage() << "\n";
+        Log.flush();
     }
     return M;
 }
 
-inline void SaveModule(llvm::Module* Module, const std::string& Filename)
+inline bool SaveModule(llvm::Module* Module, const std::string& Filename, llvm::raw_ostream& Log = llvm::errs())
 {
     if (Filename.ends_with(".ll") || Filename.ends_with(".txt"))
     {
@@ -42,16 +42,17 @@ inline void SaveModule(llvm::Module* Module, const std::string& Filename)
         WriteBitcodeToFile(*Module, Out.os(), true);
         if (EC)
         {
-            llvm::errs() << "Failed to write IR: " << EC.message() << "\n";
-            llvm::errs().flush();
-            std::exit(EXIT_FAILURE);
+            Log << "Failed to write IR: " << EC.message() << "\n";
+            Log.flush();
+            return false;
         }
         Out.keep();
     }
     else
     {
-        llvm::errs() << "Unsupported output extension for filename '" << Filename << "'\n";
-        llvm::errs().flush();
-        std::exit(EXIT_FAILURE);
+        Log << "Unsupported output extension for filename '" << Filename << "'\n";
+        Log.flush();
+        return false;
     }
+    return true;
 }
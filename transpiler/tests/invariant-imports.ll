@@ -0,0 +1,67 @@
+; RUN: opt -O2 -S %s | FileCheck %s
+; RUN: opt -O2 -S %s | FileCheck %s --check-prefix=NULL
+;
+; The shape the transpiler emits for an eager import with -inline-imports: the
+; stub loads the address with !invariant.load from a private global that only
+; riscvm_imports stores. crt0 calls riscvm_imports before the init arrays and
+; main, so no stub runs while the global is still null and the load is the
+; same value everywhere it executes. That lets LICM hoist it out of loops even
+; though the host call clobbers memory.
+
+target datalayout = "e-m:e-p:64:64-i64:64-i128:128-n32:64-S128"
+target triple = "riscv64-unknown-unknown"
+
+@import_Sleep = private global ptr null
+
+declare ptr @riscvm_resolve_dll(i32)
+declare ptr @riscvm_resolve_import(ptr, i32)
+
+; The only store to the global, it has to survive the optimizer
+; CHECK-LABEL: define void @riscvm_imports(
+; CHECK: store ptr %import_Sleep, ptr @import_Sleep
+define void @riscvm_imports() {
+entry:
+  %kernel32.dll_base = call ptr @riscvm_resolve_dll(i32 1848363543)
+  %import_Sleep = call ptr @riscvm_resolve_import(ptr %kernel32.dll_base, i32 1065713747)
+  store ptr %import_Sleep, ptr @import_Sleep, align 8
+  ret void
+}
+
+define void @Sleep(i32 %arg0) #0 {
+entry:
+  %import_address = load ptr, ptr @import_Sleep, align 8, !invariant.load !0
+  %0 = zext i32 %arg0 to i64
+  %1 = call ptr asm sideeffect "scall", "={x10},{x10},{x11},{x17},~{memory}"(ptr %import_address, i64 %0, i64 20004)
+  ret void
+}
+
+; The load moves in front of the loop, the loop body only makes host calls
+; CHECK-LABEL: define void @wait(
+; CHECK: load ptr, ptr @import_Sleep, align 8, !invariant.load
+; CHECK: loop:
+; CHECK-NOT: load ptr, ptr @import_Sleep
+; CHECK: scall
+; CHECK-NOT: load ptr, ptr @import_Sleep
+; CHECK: ret void
+define void @wait(i32 %count) {
+entry:
+  %empty = icmp eq i32 %count, 0
+  br i1 %empty, label %exit, label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  call void @Sleep(i32 %i)
+  %i.next = add nuw i32 %i, 1
+  %done = icmp eq i32 %i.next, %count
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret void
+}
+
+; Nothing folds the null initializer into a host call
+; NULL-NOT: (ptr null
+
+attributes #0 = { alwaysinline }
+
+!0 = !{}